@@ -59,6 +59,15 @@ solution "lip"
 			premake.gcc.llvm = true
 		end
 
+		newoption {
+			trigger = "with-static-storage",
+			description = "Never allocate from the heap, only from caller-provided storage"
+		}
+
+		if _OPTIONS["with-static-storage"] then
+			defines { "HAKOMARI_STATIC_STORAGE" }
+		end
+
 	project "cmp"
 		language "C"
 		kind "StaticLib"
@@ -6,15 +6,23 @@
 #include <stdint.h>
 
 #define HAKOMARI_DEVICE_TIMEOUT 10000
+#define HAKOMARI_NO_DEADLINE UINT32_MAX
 
 typedef struct hakomari_ctx_s hakomari_ctx_t;
+typedef struct hakomari_allocator_s hakomari_allocator_t;
+typedef struct hakomari_alloc_stats_s hakomari_alloc_stats_t;
 typedef struct hakomari_device_s hakomari_device_t;
 typedef struct hakomari_device_desc_s hakomari_device_desc_t;
+typedef struct hakomari_device_cfg_s hakomari_device_cfg_t;
 typedef struct hakomari_endpoint_desc_s hakomari_endpoint_desc_t;
 typedef struct hakomari_input_s hakomari_input_t;
 typedef struct hakomari_auth_handler_s hakomari_auth_handler_t;
 typedef struct hakomari_auth_ctx_s hakomari_auth_ctx_t;
 typedef struct hakomari_passphrase_screen_s hakomari_passphrase_screen_t;
+typedef struct hakomari_prepared_query_s hakomari_prepared_query_t;
+typedef struct hakomari_batch_item_s hakomari_batch_item_t;
+
+typedef struct hakomari_rect_s hakomari_rect_t;
 
 typedef char hakomari_string_t[128];
 
@@ -26,8 +34,35 @@ typedef enum hakomari_error_e
 	HAKOMARI_ERR_AUTH_REQUIRED,
 	HAKOMARI_ERR_DENIED,
 	HAKOMARI_ERR_IO,
+
+	/// Codes from here on are only returned by the library, devices never
+	/// send them
+	HAKOMARI_ERR_RETRY,
 } hakomari_error_t;
 
+typedef enum hakomari_pixel_format_e
+{
+	/// One byte per pixel
+	HAKOMARI_PIXEL_FORMAT_8,
+
+	/// One native 32-bit word per pixel (e.g: SDL_PIXELFORMAT_RGBA8888)
+	HAKOMARI_PIXEL_FORMAT_RGBA8888,
+} hakomari_pixel_format_t;
+
+typedef enum hakomari_digest_e
+{
+	HAKOMARI_DIGEST_SHA256,
+	HAKOMARI_DIGEST_SHA512,
+} hakomari_digest_t;
+
+struct hakomari_rect_s
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+};
+
 struct hakomari_device_desc_s
 {
 	/// User-friendly name
@@ -37,6 +72,70 @@ struct hakomari_device_desc_s
 	hakomari_string_t sys_name;
 };
 
+struct hakomari_allocator_s
+{
+	void* userdata;
+
+	/// Works like realloc. A size of 0 frees ptr.
+	void*(*realloc)(void* userdata, void* ptr, size_t size);
+};
+
+struct hakomari_alloc_stats_s
+{
+	/// Number of calls which allocated or resized a block
+	size_t num_allocs;
+
+	/// Number of blocks freed
+	size_t num_frees;
+};
+
+struct hakomari_device_cfg_s
+{
+	/// Size of the framing buffer in bytes (0 for default)
+	size_t io_buf_size;
+
+	/// Size of each read from a payload stream in bytes (0 for default)
+	size_t payload_chunk_size;
+
+	/// Replies up to this size in bytes are decoded in one pass, larger ones
+	/// stream the remainder (0 for default)
+	size_t rx_buf_size;
+
+	/// Grow buffers toward observed frame and payload sizes
+	bool adaptive;
+
+	/// Upper bound for adaptive growth in bytes (0 for default)
+	size_t max_buf_size;
+
+	/// Queue writes without waiting for them to be transmitted.
+	/// The output is only drained before waiting for a reply.
+	bool lazy_drain;
+
+	/// How long passphrase input events can be held back to be merged.
+	/// 0 sends every event immediately.
+	unsigned int input_coalesce_ms;
+
+	/// Maximum number of passphrase input events sent together (0 for default)
+	size_t input_batch_size;
+
+	/// Largest non-rewindable payload kept for a retry after authentication
+	/// (0 for no limit). A bigger payload fails with HAKOMARI_ERR_RETRY once
+	/// the device is authenticated and must be queried again.
+	size_t max_replay_size;
+
+	/// Maximum number of batched requests sent before their replies are read
+	/// (0 for default)
+	size_t batch_window;
+
+	/// Payload bytes kept until the device acknowledges them during a
+	/// chunked upload (0 for default)
+	size_t upload_window;
+
+	/// Bytes of results kept for cacheable queries (0 disables the cache).
+	/// Not available in static storage.
+	size_t cache_size;
+};
+
 struct hakomari_endpoint_desc_s
 {
 	/// Endpoint's type (e.g: "@provider", "GPG", "XMR")
@@ -44,12 +143,30 @@ struct hakomari_endpoint_desc_s
 
 	/// User-defined name (e.g: "My HODL")
 	hakomari_string_t name;
+
+	/// Digests the endpoint signs in place of the whole document,
+	/// one bit per hakomari_digest_t
+	unsigned int digests;
 };
 
 struct hakomari_input_s
 {
 	void* userdata;
 	hakomari_error_t(*read)(void* userdata, void* buf, size_t* size);
+
+	/// Optional: Go back to the start of the stream.
+	/// Rewindable payloads are not copied for a retry after authentication.
+	hakomari_error_t(*rewind)(void* userdata);
+
+	/// Optional: Total number of bytes in the stream
+	hakomari_error_t(*size)(void* userdata, uint64_t* size);
+
+	/// Optional: Borrow the next contiguous bytes of the stream without
+	/// copying them. An empty span marks the end of the stream.
+	hakomari_error_t(*peek)(void* userdata, const void** data, size_t* size);
+
+	/// Optional: Advance past bytes borrowed with peek
+	hakomari_error_t(*consume)(void* userdata, size_t size);
 };
 
 struct hakomari_auth_handler_s
@@ -60,16 +177,143 @@ struct hakomari_auth_handler_s
 	);
 };
 
+struct hakomari_batch_item_s
+{
+	const hakomari_endpoint_desc_t* endpoint;
+	const char* query;
+
+	/// Optional: Input for the query
+	hakomari_input_t* payload;
+
+	/// Optional: Receive the result of a successful query.
+	/// The result can only be read during the call and the returned value
+	/// becomes the item's status.
+	void* userdata;
+	hakomari_error_t(*handle_result)(void* userdata, hakomari_input_t* result);
+};
+
 struct hakomari_passphrase_screen_s
 {
 	unsigned int width;
 	unsigned int height;
 	void* image_data;
+
+	/// Area which changed since the previous prompt
+	hakomari_rect_t dirty;
 };
 
+// Static storage limits, override them before including this header.
+// A context or device in static storage never grows past them.
+
+#ifndef HAKOMARI_STATIC_MAX_DEVICES
+#define HAKOMARI_STATIC_MAX_DEVICES 4
+#endif
+
+#ifndef HAKOMARI_STATIC_MAX_INPUTS
+#define HAKOMARI_STATIC_MAX_INPUTS 2
+#endif
+
+#ifndef HAKOMARI_STATIC_ERRORSTR_SIZE
+#define HAKOMARI_STATIC_ERRORSTR_SIZE 256
+#endif
+
+#ifndef HAKOMARI_STATIC_MAX_ENDPOINTS
+#define HAKOMARI_STATIC_MAX_ENDPOINTS 16
+#endif
+
+#ifndef HAKOMARI_STATIC_IO_BUF_SIZE
+#define HAKOMARI_STATIC_IO_BUF_SIZE 1024
+#endif
+
+#ifndef HAKOMARI_STATIC_PAYLOAD_CHUNK_SIZE
+#define HAKOMARI_STATIC_PAYLOAD_CHUNK_SIZE 1024
+#endif
+
+#ifndef HAKOMARI_STATIC_RX_BUF_SIZE
+#define HAKOMARI_STATIC_RX_BUF_SIZE 1024
+#endif
+
+#ifndef HAKOMARI_STATIC_REPLAY_SIZE
+#define HAKOMARI_STATIC_REPLAY_SIZE 4096
+#endif
+
+#ifndef HAKOMARI_STATIC_MAX_PREPARED_QUERIES
+#define HAKOMARI_STATIC_MAX_PREPARED_QUERIES 4
+#endif
+
+#ifndef HAKOMARI_STATIC_SCREEN_SIZE
+#define HAKOMARI_STATIC_SCREEN_SIZE (128 * 64 / 8)
+#endif
+
+#ifndef HAKOMARI_STATIC_UPLOAD_WINDOW
+#define HAKOMARI_STATIC_UPLOAD_WINDOW 4096
+#endif
+
+/// Set to 0 to leave out the buffers of payload compression
+#ifndef HAKOMARI_STATIC_COMPRESSION
+#define HAKOMARI_STATIC_COMPRESSION 1
+#endif
+
+// Upper bounds for the library's own structures, checked at compile time
+#define HAKOMARI_CTX_OVERHEAD 256
+#define HAKOMARI_DEVICE_OVERHEAD 2048
+#define HAKOMARI_INPUT_OVERHEAD 128
+#define HAKOMARI_PREPARED_QUERY_OVERHEAD 1536
+#define HAKOMARI_CODEC_OVERHEAD (16 * 1024 + 256)
+
+#define HAKOMARI_STATIC_ALIGN 16
+#define HAKOMARI_STATIC_BLOCK(SIZE) \
+	((((SIZE) + HAKOMARI_STATIC_ALIGN - 1) / HAKOMARI_STATIC_ALIGN + 1) \
+		* HAKOMARI_STATIC_ALIGN)
+
+/// Bytes needed by hakomari_create_context_static
+#define HAKOMARI_CTX_STORAGE_SIZE ( \
+	HAKOMARI_STATIC_ALIGN \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_CTX_OVERHEAD) \
+	+ HAKOMARI_STATIC_BLOCK( \
+		HAKOMARI_STATIC_MAX_DEVICES * sizeof(hakomari_device_desc_t) \
+	) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_ERRORSTR_SIZE) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_MAX_INPUTS * HAKOMARI_INPUT_OVERHEAD) \
+)
+
+/// Bytes needed by hakomari_open_device_static
+#define HAKOMARI_DEVICE_STORAGE_SIZE ( \
+	HAKOMARI_STATIC_ALIGN \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_DEVICE_OVERHEAD) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_IO_BUF_SIZE) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_PAYLOAD_CHUNK_SIZE) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_RX_BUF_SIZE) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_REPLAY_SIZE) \
+	+ HAKOMARI_STATIC_BLOCK( \
+		HAKOMARI_STATIC_MAX_ENDPOINTS * sizeof(hakomari_endpoint_desc_t) \
+	) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_MAX_ENDPOINTS * sizeof(uint32_t)) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_SCREEN_SIZE) \
+	+ HAKOMARI_STATIC_BLOCK(HAKOMARI_STATIC_UPLOAD_WINDOW) \
+	+ HAKOMARI_STATIC_COMPRESSION * HAKOMARI_STATIC_BLOCK(HAKOMARI_CODEC_OVERHEAD) \
+	+ HAKOMARI_STATIC_BLOCK( \
+		HAKOMARI_STATIC_MAX_PREPARED_QUERIES * HAKOMARI_PREPARED_QUERY_OVERHEAD \
+	) \
+)
+
 hakomari_error_t
 hakomari_create_context(hakomari_ctx_t** context_ptr);
 
+/// Create a context which allocates through the given allocator.
+/// NULL uses the C library.
+hakomari_error_t
+hakomari_create_context_ex(
+	const hakomari_allocator_t* allocator, hakomari_ctx_t** context_ptr
+);
+
+/// Create a context inside caller-provided storage of at least
+/// HAKOMARI_CTX_STORAGE_SIZE bytes. Nothing is allocated on the heap.
+hakomari_error_t
+hakomari_create_context_static(
+	void* storage, size_t storage_size, hakomari_ctx_t** context_ptr
+);
+
 void
 hakomari_destroy_context(hakomari_ctx_t* context);
 
@@ -81,6 +325,10 @@ hakomari_set_auth_handler(
 hakomari_error_t
 hakomari_get_last_error(hakomari_ctx_t* context, const char** error);
 
+/// Allocation counters of the context and all its devices
+hakomari_error_t
+hakomari_get_alloc_stats(hakomari_ctx_t* context, hakomari_alloc_stats_t* stats);
+
 hakomari_error_t
 hakomari_enumerate_devices(hakomari_ctx_t* ctx, size_t* num_devices);
 
@@ -94,6 +342,21 @@ hakomari_open_device(
 	hakomari_ctx_t* ctx, size_t index, hakomari_device_t** device
 );
 
+hakomari_error_t
+hakomari_open_device_ex(
+	hakomari_ctx_t* ctx, size_t index, const hakomari_device_cfg_t* cfg,
+	hakomari_device_t** device
+);
+
+/// Open a device inside caller-provided storage of at least
+/// HAKOMARI_DEVICE_STORAGE_SIZE bytes.
+/// Buffer sizes come from HAKOMARI_STATIC_* and adaptive growth is disabled.
+hakomari_error_t
+hakomari_open_device_static(
+	hakomari_ctx_t* ctx, size_t index, const hakomari_device_cfg_t* cfg,
+	void* storage, size_t storage_size, hakomari_device_t** device
+);
+
 void
 hakomari_close_device(hakomari_device_t* device);
 
@@ -116,6 +379,26 @@ hakomari_destroy_endpoint(
 	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc
 );
 
+/// Create several endpoints in one transaction with a single authentication.
+/// statuses receives one status per descriptor. Devices without transactions
+/// get one request per descriptor, a declined passphrase then fails the
+/// remaining ones with HAKOMARI_ERR_AUTH_REQUIRED.
+hakomari_error_t
+hakomari_create_endpoints(
+	hakomari_device_t* device,
+	const hakomari_endpoint_desc_t* descs, size_t num_descs,
+	hakomari_error_t* statuses
+);
+
+/// Destroy several endpoints in one transaction with a single
+/// authentication. statuses receives one status per descriptor.
+hakomari_error_t
+hakomari_destroy_endpoints(
+	hakomari_device_t* device,
+	const hakomari_endpoint_desc_t* descs, size_t num_descs,
+	hakomari_error_t* statuses
+);
+
 hakomari_error_t
 hakomari_query_endpoint(
 	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
@@ -123,6 +406,67 @@ hakomari_query_endpoint(
 	hakomari_input_t** result
 );
 
+/// Same as hakomari_query_endpoint but, when the endpoint supports the
+/// digest, the payload is hashed on the host and only its digest and length
+/// are sent. Otherwise the whole payload is sent.
+/// SHA-256 uses the SHA extensions when the CPU has them, SHA-512 is always
+/// computed in portable code.
+hakomari_error_t
+hakomari_query_endpoint_digest(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const hakomari_string_t query, hakomari_digest_t digest,
+	hakomari_input_t* payload, hakomari_input_t** result
+);
+
+/// Serve repeated queries from memory for ttl_ms after their first result.
+/// A NULL desc matches every endpoint and a NULL query every query of the
+/// endpoint. The most specific rule applies, a ttl_ms of 0 turns caching
+/// off for what it matches. Only mark queries whose result depends on
+/// nothing but the endpoint, query and payload.
+/// A result is stored once it has been read to the end. Results which fit
+/// in the receive buffer are stored as soon as the last byte is read, larger
+/// ones once a read returns fewer bytes than requested.
+hakomari_error_t
+hakomari_set_query_cache(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const char* query, unsigned int ttl_ms
+);
+
+/// Drop every cached result
+void
+hakomari_clear_query_cache(hakomari_device_t* device);
+
+/// Encode the invariant part of a query once.
+/// Executing it only patches in the transaction id and request flags.
+/// It is encoded again after the endpoint table changes.
+hakomari_error_t
+hakomari_prepare_query(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const hakomari_string_t query, hakomari_prepared_query_t** prepared
+);
+
+/// Same as hakomari_query_endpoint with the prepared endpoint and query
+hakomari_error_t
+hakomari_query_prepared(
+	hakomari_prepared_query_t* prepared, hakomari_input_t* payload,
+	hakomari_input_t** result
+);
+
+void
+hakomari_destroy_prepared_query(hakomari_prepared_query_t* prepared);
+
+/// Run many queries in one call.
+/// Consecutive items for the same endpoint are authenticated once, then
+/// their requests are sent back to back before the replies are read.
+/// statuses receives one status per item. Failed items are not retried.
+/// Return the error which stopped the batch, if any.
+hakomari_error_t
+hakomari_query_batch(
+	hakomari_device_t* device,
+	const hakomari_batch_item_t* items, size_t num_items,
+	hakomari_error_t* statuses
+);
+
 hakomari_error_t
 hakomari_inspect_passphrase_screen(
 	hakomari_auth_ctx_t* auth_ctx,
@@ -135,6 +479,47 @@ hakomari_input_passphrase(
 	unsigned int x, unsigned int y, bool down
 );
 
+hakomari_error_t
+hakomari_flush_passphrase_input(hakomari_auth_ctx_t* auth_ctx);
+
+/// Time until held back input events must be flushed or HAKOMARI_NO_DEADLINE
+hakomari_error_t
+hakomari_passphrase_input_deadline(
+	hakomari_auth_ctx_t* auth_ctx, unsigned int* timeout_ms
+);
+
+/// Expand the 1bpp passphrase screen into a caller-supplied image.
+/// Lit pixels are written as fg, the others as bg.
+hakomari_error_t
+hakomari_unpack_passphrase_screen(
+	const hakomari_passphrase_screen_t* screen,
+	void* dst, size_t pitch, hakomari_pixel_format_t format,
+	uint32_t fg, uint32_t bg
+);
+
+/// Same as hakomari_unpack_passphrase_screen but only for the given area.
+/// dst points to the top-left pixel of that area.
+hakomari_error_t
+hakomari_unpack_passphrase_screen_rect(
+	const hakomari_passphrase_screen_t* screen, const hakomari_rect_t* rect,
+	void* dst, size_t pitch, hakomari_pixel_format_t format,
+	uint32_t fg, uint32_t bg
+);
+
+/// Create a rewindable input reading from memory owned by the caller
+hakomari_error_t
+hakomari_input_from_memory(
+	hakomari_ctx_t* ctx, const void* data, size_t size, hakomari_input_t** input
+);
+
+/// Create a rewindable input mapping a regular file into memory
+hakomari_error_t
+hakomari_input_from_file(hakomari_ctx_t* ctx, int fd, hakomari_input_t** input);
+
+/// Destroy an input created by hakomari_input_from_*
+void
+hakomari_destroy_input(hakomari_input_t* input);
+
 static inline hakomari_error_t
 hakomari_read(hakomari_input_t* stream, void* buf, size_t* size)
 {
@@ -149,8 +534,9 @@ hakomari_get_pixel(
 {
 	if(x >= screen->width || y >= screen->height) { return false; }
 
-	uint8_t byte = ((uint8_t*)(screen->image_data))[(x + y * screen->width) / 8];
-	return (byte >> (x % 8)) & 1;
+	size_t index = x + (size_t)y * screen->width;
+	uint8_t byte = ((uint8_t*)(screen->image_data))[index / 8];
+	return (byte >> (index % 8)) & 1;
 }
 
 #endif
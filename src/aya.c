@@ -1,3 +1,7 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <SDL2/SDL.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,14 +24,57 @@
 #include "optparse-help.h"
 
 #define PROG_NAME "aya"
+#define INPUT_COALESCE_MS 10
+#define KEEPALIVE_INTERVAL (HAKOMARI_DEVICE_TIMEOUT / 2)
+#define PIXEL_ON 0xFFFFFFFF
+#define PIXEL_OFF 0x000000FF
+#define INPUT_QUEUE_SIZE 256 // Must be a power of 2
+#define PENDING_INPUT_RETRY 10 // ms
 #define quit(code) do { exit_code = code; goto quit; } while(0);
 
+struct input_event_s
+{
+	int x;
+	int y;
+	bool down;
+};
+
+// Single-producer single-consumer queue from the UI thread to the I/O thread
+struct input_queue_s
+{
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	struct input_event_s events[INPUT_QUEUE_SIZE];
+};
+
+struct passphrase_io_s
+{
+	hakomari_auth_ctx_t* auth_ctx;
+	SDL_sem* wakeup;
+	SDL_atomic_t stop;
+	SDL_atomic_t done;
+	int last_x;
+	int last_y;
+	struct input_queue_s queue;
+};
+
+// Input the queue had no room for, kept by the UI thread until it has
+struct pending_input_s
+{
+	struct input_event_s* presses;
+	size_t num_presses;
+	size_t presses_capacity;
+	bool has_move;
+	struct input_event_s move;
+};
+
 struct ask_passphrase_ctx_s
 {
 	hakomari_ctx_t* hakomari_ctx;
 	SDL_Window* window;
 	SDL_Renderer* renderer;
 	SDL_Texture* texture;
+	uint32_t* pixels;
 	unsigned int last_width;
 	unsigned int last_height;
 };
@@ -39,6 +86,172 @@ std_read(void* userdata, void* buf, size_t* size)
 	return ferror(userdata) ? HAKOMARI_ERR_IO : HAKOMARI_OK;
 }
 
+static bool
+input_queue_push(struct input_queue_s* queue, const struct input_event_s* event)
+{
+	int head = SDL_AtomicGet(&queue->head);
+	int tail = SDL_AtomicGet(&queue->tail);
+	if(head - tail == INPUT_QUEUE_SIZE) { return false; }
+
+	queue->events[head & (INPUT_QUEUE_SIZE - 1)] = *event;
+	SDL_AtomicSet(&queue->head, head + 1);
+	return true;
+}
+
+static bool
+input_queue_pop(struct input_queue_s* queue, struct input_event_s* event)
+{
+	int tail = SDL_AtomicGet(&queue->tail);
+	int head = SDL_AtomicGet(&queue->head);
+	if(head == tail) { return false; }
+
+	*event = queue->events[tail & (INPUT_QUEUE_SIZE - 1)];
+	SDL_AtomicSet(&queue->tail, tail + 1);
+	return true;
+}
+
+static int
+passphrase_io_thread(void* userdata)
+{
+	struct passphrase_io_s* io = userdata;
+	hakomari_error_t error = HAKOMARI_OK;
+	uint32_t keepalive_ticks = SDL_GetTicks() + KEEPALIVE_INTERVAL;
+
+	while(true)
+	{
+		// Events queued before the stop request are still sent
+		bool stopping = SDL_AtomicGet(&io->stop);
+		unsigned int input_deadline;
+		if(!stopping)
+		{
+			// Sleep until an event is queued, input is due or the device needs
+			// a keepalive
+			uint32_t current_ticks = SDL_GetTicks();
+			unsigned int timeout = SDL_TICKS_PASSED(current_ticks, keepalive_ticks)
+				? 0 : keepalive_ticks - current_ticks;
+			hakomari_passphrase_input_deadline(io->auth_ctx, &input_deadline);
+			if(input_deadline < timeout) { timeout = input_deadline; }
+
+			SDL_SemWaitTimeout(io->wakeup, timeout);
+		}
+
+		struct input_event_s event;
+		while(error == HAKOMARI_OK && input_queue_pop(&io->queue, &event))
+		{
+			io->last_x = event.x;
+			io->last_y = event.y;
+			keepalive_ticks = SDL_GetTicks() + KEEPALIVE_INTERVAL;
+			error = hakomari_input_passphrase(
+				io->auth_ctx, event.x, event.y, event.down
+			);
+		}
+
+		if(stopping)
+		{
+			if(error == HAKOMARI_OK)
+			{
+				error = hakomari_flush_passphrase_input(io->auth_ctx);
+			}
+			break;
+		}
+
+		// Keep alive by sending the last known mouse position
+		uint32_t current_ticks = SDL_GetTicks();
+		if(error == HAKOMARI_OK && SDL_TICKS_PASSED(current_ticks, keepalive_ticks))
+		{
+			keepalive_ticks = current_ticks + KEEPALIVE_INTERVAL;
+			error = hakomari_input_passphrase(
+				io->auth_ctx, io->last_x, io->last_y, false
+			);
+		}
+
+		hakomari_passphrase_input_deadline(io->auth_ctx, &input_deadline);
+		if(error == HAKOMARI_OK && input_deadline == 0)
+		{
+			error = hakomari_flush_passphrase_input(io->auth_ctx);
+		}
+
+		if(error != HAKOMARI_OK)
+		{
+			// Wake up the UI thread
+			SDL_Event event = { .type = SDL_USEREVENT };
+			SDL_PushEvent(&event);
+			break;
+		}
+	}
+
+	SDL_AtomicSet(&io->done, 1);
+	return (int)error;
+}
+
+static bool
+pending_input_add(struct pending_input_s* pending, const struct input_event_s* event)
+{
+	// Only the latest position matters
+	if(!event->down)
+	{
+		pending->move = *event;
+		pending->has_move = true;
+		return true;
+	}
+
+	// A press carries its own position, which an older move would undo
+	pending->has_move = false;
+	if(pending->num_presses == pending->presses_capacity)
+	{
+		size_t capacity = pending->presses_capacity > 0
+			? pending->presses_capacity * 2 : 16;
+		struct input_event_s* presses = realloc(
+			pending->presses, capacity * sizeof(struct input_event_s)
+		);
+		if(presses == NULL) { return false; }
+
+		pending->presses = presses;
+		pending->presses_capacity = capacity;
+	}
+
+	pending->presses[pending->num_presses++] = *event;
+	return true;
+}
+
+static bool
+pending_input_empty(const struct pending_input_s* pending)
+{
+	return pending->num_presses == 0 && !pending->has_move;
+}
+
+static bool
+pending_input_flush(struct pending_input_s* pending, struct input_queue_s* queue)
+{
+	size_t num_sent = 0;
+	while(
+		num_sent < pending->num_presses
+		&& input_queue_push(queue, &pending->presses[num_sent])
+	)
+	{
+		++num_sent;
+	}
+
+	pending->num_presses -= num_sent;
+	memmove(
+		pending->presses, pending->presses + num_sent,
+		pending->num_presses * sizeof(struct input_event_s)
+	);
+
+	// Presses go first so that a move never overtakes them
+	if(true
+		&& pending->num_presses == 0
+		&& pending->has_move
+		&& input_queue_push(queue, &pending->move)
+	)
+	{
+		pending->has_move = false;
+		++num_sent;
+	}
+
+	return num_sent > 0;
+}
+
 static bool
 parse_command_args(int argc, char* command_argv[], ...)
 {
@@ -121,10 +334,12 @@ ask_passphrase(void* userdata, hakomari_auth_ctx_t* auth_ctx)
 
 	if(ctx->window == NULL)
 	{
+		// Let SDL pick any renderer, including a software one: the screen is
+		// only redrawn when something changes.
 		int status = SDL_CreateWindowAndRenderer(
 			(int)passphrase_screen->width,
 			(int)passphrase_screen->height,
-			SDL_WINDOW_INPUT_FOCUS | SDL_WINDOW_OPENGL,
+			SDL_WINDOW_INPUT_FOCUS,
 			&ctx->window, &ctx->renderer
 		);
 
@@ -137,23 +352,6 @@ ask_passphrase(void* userdata, hakomari_auth_ctx_t* auth_ctx)
 
 			return HAKOMARI_ERR_IO;
 		}
-
-
-		if(SDL_GL_SetSwapInterval(-1) < 0)
-		{
-			fprintf(
-				stderr, PROG_NAME ": Could not set vsync: %s\n",
-				SDL_GetError()
-			);
-
-			if(SDL_GL_SetSwapInterval(1) < 0)
-			{
-				fprintf(
-					stderr, PROG_NAME ": Could not set vsync: %s\n",
-					SDL_GetError()
-				);
-			}
-		}
 	}
 	else
 	{
@@ -165,7 +363,7 @@ ask_passphrase(void* userdata, hakomari_auth_ctx_t* auth_ctx)
 		SDL_ShowWindow(ctx->window);
 	}
 
-	// Render passphrase screen to a texture
+	// Upload passphrase screen to a texture
 	if(ctx->texture != NULL
 		&& (ctx->last_width != passphrase_screen->width
 			|| ctx->last_height != passphrase_screen->height)
@@ -175,12 +373,19 @@ ask_passphrase(void* userdata, hakomari_auth_ctx_t* auth_ctx)
 		ctx->texture = NULL;
 	}
 
+	// Only the changed area needs to be uploaded to an existing texture
+	hakomari_rect_t dirty = passphrase_screen->dirty;
 	if(ctx->texture == NULL)
 	{
+		dirty = (hakomari_rect_t){
+			.width = passphrase_screen->width,
+			.height = passphrase_screen->height
+		};
+
 		ctx->texture = SDL_CreateTexture(
 			ctx->renderer,
 			SDL_PIXELFORMAT_RGBA8888,
-			SDL_TEXTUREACCESS_TARGET,
+			SDL_TEXTUREACCESS_STREAMING,
 			passphrase_screen->width,
 			passphrase_screen->height
 		);
@@ -191,83 +396,162 @@ ask_passphrase(void* userdata, hakomari_auth_ctx_t* auth_ctx)
 				stderr, PROG_NAME ": Could not create texture: %s\n",
 				SDL_GetError()
 			);
+
+			return HAKOMARI_ERR_IO;
 		}
 
+		uint32_t* pixels = realloc(
+			ctx->pixels,
+			sizeof(uint32_t) * passphrase_screen->width * passphrase_screen->height
+		);
+		if(pixels == NULL)
+		{
+			fprintf(stderr, PROG_NAME ": Out of memory\n");
+			return HAKOMARI_ERR_MEMORY;
+		}
+
+		ctx->pixels = pixels;
 		ctx->last_width = passphrase_screen->width;
 		ctx->last_height = passphrase_screen->height;
 	}
 
-	SDL_SetRenderTarget(ctx->renderer, ctx->texture);
-	SDL_SetRenderDrawColor(ctx->renderer, 0, 0, 0, 0);
-	SDL_RenderClear(ctx->renderer);
-	SDL_SetRenderDrawColor(ctx->renderer, 255, 255, 255, 255);
-	for(unsigned int y = 0; y < passphrase_screen->height; ++y)
+	if(dirty.width > 0 && dirty.height > 0)
 	{
-		for(unsigned int x = 0; x < passphrase_screen->width; ++x)
-		{
-			if(hakomari_get_pixel(passphrase_screen, x, y))
-			{
-				SDL_RenderDrawPoint(ctx->renderer, x, y);
-			}
-		}
+		int pitch = (int)(sizeof(uint32_t) * passphrase_screen->width);
+		uint32_t* origin =
+			ctx->pixels + dirty.x + dirty.y * passphrase_screen->width;
+		SDL_Rect area = {
+			.x = (int)dirty.x, .y = (int)dirty.y,
+			.w = (int)dirty.width, .h = (int)dirty.height
+		};
+
+		hakomari_unpack_passphrase_screen_rect(
+			passphrase_screen, &dirty, origin, pitch,
+			HAKOMARI_PIXEL_FORMAT_RGBA8888, PIXEL_ON, PIXEL_OFF
+		);
+		SDL_UpdateTexture(ctx->texture, &area, origin, pitch);
 	}
-	SDL_RenderPresent(ctx->renderer);
-	SDL_SetRenderTarget(ctx->renderer, NULL);
 
 	SDL_RaiseWindow(ctx->window);
 
+	// Device I/O happens on its own thread so that a slow device never
+	// stalls rendering or event handling
+	struct passphrase_io_s io = { .auth_ctx = auth_ctx };
+	SDL_GetMouseState(&io.last_x, &io.last_y);
+	SDL_FlushEvent(SDL_USEREVENT);
+
+	io.wakeup = SDL_CreateSemaphore(0);
+	if(io.wakeup == NULL)
+	{
+		fprintf(
+			stderr, PROG_NAME ": Could not create semaphore: %s\n",
+			SDL_GetError()
+		);
+		SDL_HideWindow(ctx->window);
+		return HAKOMARI_ERR_MEMORY;
+	}
+
+	SDL_Thread* io_thread = SDL_CreateThread(
+		passphrase_io_thread, PROG_NAME "-io", &io
+	);
+	if(io_thread == NULL)
+	{
+		fprintf(
+			stderr, PROG_NAME ": Could not create thread: %s\n",
+			SDL_GetError()
+		);
+		SDL_DestroySemaphore(io.wakeup);
+		SDL_HideWindow(ctx->window);
+		return HAKOMARI_ERR_MEMORY;
+	}
+
 	bool running = true;
-	uint32_t last_ticks = SDL_GetTicks();
-	error = HAKOMARI_OK;
+	bool redraw = true;
+	bool out_of_memory = false;
+	struct pending_input_s pending = { 0 };
 
-    while(running)
+	while(running)
 	{
-		int mouse_x, mouse_y;
-		bool mouse_down = false;
-		bool has_event = false;
+		if(redraw)
+		{
+			SDL_RenderCopy(ctx->renderer, ctx->texture, NULL, NULL);
+			SDL_RenderPresent(ctx->renderer);
+			redraw = false;
+		}
 
+		// Input the queue had no room for is offered again on the next pass,
+		// the UI thread never waits for the device
 		SDL_Event event;
-		while(SDL_PollEvent(&event))
+		bool has_event = pending_input_empty(&pending)
+			? SDL_WaitEvent(&event)
+			: SDL_WaitEventTimeout(&event, PENDING_INPUT_RETRY);
+
+		while(running && has_event)
 		{
+			struct input_event_s input;
+			bool has_input = false;
+
 			switch(event.type)
 			{
 				case SDL_MOUSEMOTION:
-					has_event = true;
-					mouse_x = event.motion.x;
-					mouse_y = event.motion.y;
+					input = (struct input_event_s){
+						.x = event.motion.x, .y = event.motion.y, .down = false
+					};
+					has_input = true;
 					break;
 				case SDL_MOUSEBUTTONDOWN:
-					has_event = true;
-					mouse_down = true;
-					mouse_x = event.button.x;
-					mouse_y = event.button.y;
+					input = (struct input_event_s){
+						.x = event.button.x, .y = event.button.y, .down = true
+					};
+					has_input = true;
+					break;
+				case SDL_WINDOWEVENT:
+					redraw = true;
 					break;
+				case SDL_USEREVENT:
 				case SDL_QUIT:
 					running = false;
 					break;
 			}
+
+			if(has_input && !pending_input_add(&pending, &input))
+			{
+				out_of_memory = true;
+				running = false;
+			}
+
+			has_event = SDL_PollEvent(&event);
 		}
 
-		// Keep alive by sending current mouse position
-		uint32_t current_ticks = SDL_GetTicks();
-		if(current_ticks - last_ticks > HAKOMARI_DEVICE_TIMEOUT / 2)
+		if(SDL_AtomicGet(&io.done))
 		{
-			has_event = true;
-			SDL_GetMouseState(&mouse_x, &mouse_y);
-			last_ticks = current_ticks;
+			// Nothing reads the queue anymore
+			pending.num_presses = 0;
+			pending.has_move = false;
 		}
-
-		if(has_event)
+		else if(pending_input_flush(&pending, &io.queue))
 		{
-			error = hakomari_input_passphrase(auth_ctx, mouse_x, mouse_y, mouse_down);
-			if(error != HAKOMARI_OK) { running = false; continue; }
+			SDL_SemPost(io.wakeup);
 		}
+	}
 
-        SDL_SetRenderDrawColor(ctx->renderer, 0, 0, 0, 0);
-        SDL_RenderClear(ctx->renderer);
-		SDL_RenderCopy(ctx->renderer, ctx->texture, NULL, NULL);
-        SDL_RenderPresent(ctx->renderer);
-    }
+	// The I/O thread sends what is queued before it stops, so everything
+	// still pending must be queued first. The dialog is closing: waiting for
+	// the device is fine now.
+	while(!pending_input_empty(&pending) && !SDL_AtomicGet(&io.done))
+	{
+		if(!pending_input_flush(&pending, &io.queue)) { SDL_Delay(1); }
+		SDL_SemPost(io.wakeup);
+	}
+	free(pending.presses);
+
+	SDL_AtomicSet(&io.stop, 1);
+	SDL_SemPost(io.wakeup);
+
+	int io_status;
+	SDL_WaitThread(io_thread, &io_status);
+	SDL_DestroySemaphore(io.wakeup);
+	error = out_of_memory ? HAKOMARI_ERR_MEMORY : (hakomari_error_t)io_status;
 
 	SDL_HideWindow(ctx->window);
 
@@ -306,6 +590,7 @@ main(int argc, char* argv[])
 	size_t device_index = 0;
 	hakomari_ctx_t* ctx = NULL;
 	hakomari_device_t* device = NULL;
+	hakomari_input_t* file_payload = NULL;
 	struct ask_passphrase_ctx_s ask_passphrase_ctx = { 0 };
 	char* str_end;
 	const char* error;
@@ -410,7 +695,12 @@ main(int argc, char* argv[])
 		quit(EXIT_FAILURE);
 	}
 
-	if(hakomari_open_device(ctx, device_index, &device) != HAKOMARI_OK)
+	hakomari_device_cfg_t device_cfg = {
+		.adaptive = true,
+		.lazy_drain = true,
+		.input_coalesce_ms = INPUT_COALESCE_MS,
+	};
+	if(hakomari_open_device_ex(ctx, device_index, &device_cfg, &device) != HAKOMARI_OK)
 	{
 		hakomari_get_last_error(ctx, &error);
 		fprintf(stderr, PROG_NAME ": Could not open device: %s\n", error);
@@ -490,10 +780,18 @@ main(int argc, char* argv[])
 			quit(EXIT_FAILURE);
 		}
 
+		// A regular file on stdin can be mapped and replayed without a copy
+		hakomari_input_t* payload = no_input ? NULL : &query_payload;
+		if(!no_input && hakomari_input_from_file(
+			ctx, fileno(stdin), &file_payload
+		) == HAKOMARI_OK)
+		{
+			payload = file_payload;
+		}
+
 		hakomari_input_t* result = NULL;
 		if(hakomari_query_endpoint(
-			device, &endpoint_desc, query,
-			no_input ? NULL : &query_payload, &result
+			device, &endpoint_desc, query, payload, &result
 		) != HAKOMARI_OK)
 		{
 			hakomari_get_last_error(ctx, &error);
@@ -529,8 +827,10 @@ main(int argc, char* argv[])
 
 quit:
 	if(ask_passphrase_ctx.texture) { SDL_DestroyTexture(ask_passphrase_ctx.texture); }
+	free(ask_passphrase_ctx.pixels);
 	if(ask_passphrase_ctx.renderer) { SDL_DestroyRenderer(ask_passphrase_ctx.renderer); }
 	if(ask_passphrase_ctx.window) { SDL_DestroyWindow(ask_passphrase_ctx.window); }
+	if(file_payload != NULL) { hakomari_destroy_input(file_payload); }
 	if(device != NULL) { hakomari_close_device(device); }
 	if(ctx != NULL) { hakomari_destroy_context(ctx); }
 	SDL_Quit();
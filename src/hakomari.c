@@ -1,6 +1,50 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "hakomari.h"
 #include <stdint.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAKOMARI_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAKOMARI_NEON
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#define HAKOMARI_CRC32_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAKOMARI_CRC32_ARM
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Not enabled at build time: use it anyway when the CPU has it
+#include <nmmintrin.h>
+#define HAKOMARI_CRC32_SSE42
+#define HAKOMARI_CRC32_DISPATCH
+#endif
+#if !defined(HAKOMARI_CRC32_SSE42) && !defined(HAKOMARI_CRC32_ARM)
+#define HAKOMARI_CRC32_TABLE
+#elif defined(HAKOMARI_CRC32_DISPATCH)
+#define HAKOMARI_CRC32_TABLE
+#endif
+#if defined(__SHA__) && defined(__SSE4_1__)
+#include <immintrin.h>
+#define HAKOMARI_SHA_NI
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAKOMARI_SHA_NI
+#define HAKOMARI_SHA_DISPATCH
+#endif
 #include <cmp/cmp.h>
 #include <libserialport.h>
 #define SLIPPER_API static
@@ -8,7 +52,37 @@
 #include "slipper.h"
 
 #define HAKOMARI_BUF_SIZE 1024
+#define HAKOMARI_MAX_BUF_SIZE (64 * 1024)
+#define HAKOMARI_RX_BUF_SIZE 4096
+#define HAKOMARI_TX_BUF_SIZE 512
+#define HAKOMARI_INPUT_BATCH_SIZE 32
+#define HAKOMARI_BATCH_WINDOW 32
+#define HAKOMARI_UPLOAD_WINDOW (16 * 1024)
+#define HAKOMARI_UPLOAD_ATTEMPTS 4
+#define HAKOMARI_NAK_ATTEMPTS 3
+#define HAKOMARI_COMPRESSION_BLOCK_SIZE 4096
+#define HAKOMARI_COMPRESSION_MIN_SIZE 64
+#define HAKOMARI_BLOCK_HEADER_SIZE 2
+#define HAKOMARI_BLOCK_STORED 0x8000
+#define HAKOMARI_LZ_HASH_BITS 11
+#define HAKOMARI_LZ_MIN_MATCH 4
+#define HAKOMARI_LZ_LAST_LITERALS 5
+#define HAKOMARI_LZ_MATCH_LIMIT 12
+#define HAKOMARI_CODEC_TABLE_SIZE (sizeof(uint16_t) << HAKOMARI_LZ_HASH_BITS)
+// Hash table, raw and encoded transmit blocks, decoded receive block
+#define HAKOMARI_CODEC_SIZE ( \
+	HAKOMARI_CODEC_TABLE_SIZE \
+	+ 3 * HAKOMARI_COMPRESSION_BLOCK_SIZE + HAKOMARI_BLOCK_HEADER_SIZE \
+)
+#define HAKOMARI_DIGEST_MAX_SIZE 64
+#define HAKOMARI_DIGEST_MAX_BLOCK_SIZE 128
+// [str algorithm, u64 length, bin digest]
+#define HAKOMARI_DIGEST_SUMMARY_SIZE 96
+#define HAKOMARI_MAX_CACHE_HINTS 8
 #define HAKOMARI_PRODUCT_PREFIX "Hakomari"
+#define HAKOMARI_ARENA_NONE SIZE_MAX
+#define HAKOMARI_HANDLE_UNBOUND UINT32_MAX
+#define HAKOMARI_HANDLE_FAILED (UINT32_MAX - 1)
 
 #define HAKOMARI_WITH_AUTH(OP, DEVICE, ENDPOINT, ...) \
 	do { \
@@ -25,25 +99,206 @@
 		return error; \
 	} while(0)
 
+typedef enum hakomari_cap_e
+{
+	HAKOMARI_CAP_SCREEN_DELTA = 1 << 0,
+	HAKOMARI_CAP_AUTH_STATUS = 1 << 1,
+	HAKOMARI_CAP_BIND = 1 << 2,
+	HAKOMARI_CAP_COMPACT_SCHEMA = 1 << 3,
+	HAKOMARI_CAP_MANY_ENDPOINTS = 1 << 4,
+	HAKOMARI_CAP_CHUNKED_UPLOAD = 1 << 5,
+	HAKOMARI_CAP_FRAME_CHECKSUM = 1 << 6,
+	HAKOMARI_CAP_COBS_FRAMING = 1 << 7,
+	HAKOMARI_CAP_COMPRESSION = 1 << 8,
+	HAKOMARI_CAP_DIGEST_SIGN = 1 << 9,
+	HAKOMARI_CAP_CACHE_HINTS = 1 << 10,
+} hakomari_cap_t;
+
+static const struct hakomari_cap_name_s
+{
+	hakomari_cap_t cap;
+	const char* name;
+} HAKOMARI_CAP_NAMES[] = {
+	{ HAKOMARI_CAP_SCREEN_DELTA, "screen-delta" },
+	{ HAKOMARI_CAP_AUTH_STATUS, "auth-status" },
+	{ HAKOMARI_CAP_BIND, "bind" },
+	{ HAKOMARI_CAP_COMPACT_SCHEMA, "compact-schema" },
+	{ HAKOMARI_CAP_MANY_ENDPOINTS, "many-endpoints" },
+	{ HAKOMARI_CAP_CHUNKED_UPLOAD, "chunked-upload" },
+	{ HAKOMARI_CAP_FRAME_CHECKSUM, "frame-checksum" },
+	{ HAKOMARI_CAP_COBS_FRAMING, "cobs-framing" },
+	{ HAKOMARI_CAP_COMPRESSION, "compression" },
+	{ HAKOMARI_CAP_DIGEST_SIGN, "digest-sign" },
+	{ HAKOMARI_CAP_CACHE_HINTS, "cache-hints" },
+};
+
+// Reply fields. With the compact schema, a field is keyed by its position
+// in these tables instead of its name: only append to them.
+
+#define HAKOMARI_ENDPOINT_FIELDS(X) \
+	X(TYPE, "type") \
+	X(NAME, "name") \
+	X(DIGESTS, "digests") \
+	X(CACHEABLE, "cacheable")
+
+#define HAKOMARI_SCREEN_FIELDS(X) \
+	X(WIDTH, "width") \
+	X(HEIGHT, "height") \
+	X(HASH, "hash") \
+	X(IMAGE_DATA, "image_data") \
+	X(DELTAS, "deltas")
+
+#define HAKOMARI_ENDPOINT_FIELD_ID(ID, NAME) HAKOMARI_ENDPOINT_FIELD_##ID,
+#define HAKOMARI_SCREEN_FIELD_ID(ID, NAME) HAKOMARI_SCREEN_FIELD_##ID,
+#define HAKOMARI_FIELD_NAME(ID, NAME) NAME,
+
+typedef enum hakomari_endpoint_field_e
+{
+	HAKOMARI_ENDPOINT_FIELDS(HAKOMARI_ENDPOINT_FIELD_ID)
+	HAKOMARI_ENDPOINT_FIELD_COUNT
+} hakomari_endpoint_field_t;
+
+typedef enum hakomari_screen_field_e
+{
+	HAKOMARI_SCREEN_FIELDS(HAKOMARI_SCREEN_FIELD_ID)
+	HAKOMARI_SCREEN_FIELD_COUNT
+} hakomari_screen_field_t;
+
+static const char* const HAKOMARI_ENDPOINT_FIELD_NAMES[] = {
+	HAKOMARI_ENDPOINT_FIELDS(HAKOMARI_FIELD_NAME)
+};
+
+static const char* const HAKOMARI_SCREEN_FIELD_NAMES[] = {
+	HAKOMARI_SCREEN_FIELDS(HAKOMARI_FIELD_NAME)
+};
+
 typedef enum hakomari_frame_type_e
 {
 	HAKOMARI_FRAME_REQ = 0,
 	HAKOMARI_FRAME_REP,
+	HAKOMARI_FRAME_CHUNK,
+	HAKOMARI_FRAME_ACK,
+	HAKOMARI_FRAME_NAK,
 } hakomari_frame_type_t;
 
+typedef enum hakomari_request_flag_e
+{
+	// The payload follows in CHUNK frames instead of the request frame
+	HAKOMARI_REQUEST_CHUNKED = 1 << 0,
+	// The payload is a stream of compressed blocks
+	HAKOMARI_REQUEST_COMPRESSED = 1 << 1,
+	// The payload is the digest and length of the document
+	HAKOMARI_REQUEST_DIGEST = 1 << 2,
+} hakomari_request_flag_t;
+
+typedef enum hakomari_reply_flag_e
+{
+	// The body is a stream of compressed blocks
+	HAKOMARI_REPLY_COMPRESSED = 1 << 0,
+} hakomari_reply_flag_t;
+
+static const struct hakomari_digest_info_s
+{
+	const char* name;
+	size_t size;
+	size_t block_size;
+} HAKOMARI_DIGESTS[] = {
+	[HAKOMARI_DIGEST_SHA256] = { "sha256", 32, 64 },
+	[HAKOMARI_DIGEST_SHA512] = { "sha512", 64, 128 },
+};
+
+struct hakomari_digest_ctx_s
+{
+	hakomari_digest_t digest;
+	union
+	{
+		uint32_t sha256[8];
+		uint64_t sha512[8];
+	} state;
+	uint64_t length;
+	size_t block_size;
+	size_t block_used;
+	uint8_t block[HAKOMARI_DIGEST_MAX_BLOCK_SIZE];
+};
+
+struct hakomari_input_event_s
+{
+	unsigned int x;
+	unsigned int y;
+	bool down;
+};
+
 struct hakomari_auth_ctx_s
 {
 	hakomari_device_t* device;
 	const hakomari_endpoint_desc_t* endpoint;
 	bool passphrase_inputed;
+	uint64_t batch_start;
+	size_t num_pending_events;
+	struct hakomari_input_event_s pending_events[HAKOMARI_INPUT_BATCH_SIZE];
+};
+
+struct hakomari_arena_s
+{
+	uint8_t* memory;
+	size_t size;
+	size_t used;
+	size_t last;
+};
+
+struct hakomari_arena_block_s
+{
+	size_t size;
+	size_t prev;
+};
+
+struct hakomari_pool_s
+{
+	uint8_t* memory;
+	size_t slot_size;
+	void* free_slots;
+};
+
+struct hakomari_compressor_s
+{
+	hakomari_input_t input;
+	hakomari_input_t* source;
+	bool record;
+	bool sampled;
+	bool incompressible;
+	bool drained;
+	size_t encoded_pos;
+	size_t encoded_size;
+};
+
+struct hakomari_prepared_query_s
+{
+	hakomari_device_t* device;
+	bool has_endpoint;
+	hakomari_endpoint_desc_t endpoint;
+	hakomari_string_t query;
+	uint32_t endpoint_generation;
+	uint32_t endpoint_index;
+	uint32_t handle;
+	bool escaped;
+	size_t prefix_size;
+	size_t suffix_size;
+	uint8_t header[];
 };
 
 struct hakomari_ctx_s
 {
+	hakomari_allocator_t allocator;
+	hakomari_alloc_stats_t alloc_stats;
+	struct hakomari_arena_s arena;
+	struct hakomari_pool_s input_pool;
+	bool static_storage;
 	hakomari_error_t last_error;
 	const char* errorstr;
 	char* copied_errorstr;
+	size_t errorstr_capacity;
 	size_t num_devices;
+	size_t devices_capacity;
 	struct sp_port_config* port_config;
 	hakomari_device_desc_t* devices;
 	hakomari_auth_handler_t* auth_handler;
@@ -51,29 +306,366 @@ struct hakomari_ctx_s
 
 struct hakomari_mem_stream_s
 {
+	hakomari_device_t* device;
 	char* buff;
 	size_t capacity;
+	size_t max_size;
+	bool overflowed;
 	size_t read_pos;
 	size_t write_pos;
 	hakomari_input_t input;
 };
 
+struct hakomari_memory_input_s
+{
+	hakomari_input_t input;
+	const uint8_t* data;
+	size_t size;
+	size_t pos;
+	hakomari_ctx_t* ctx;
+	bool mapped;
+#ifdef _WIN32
+	HANDLE mapping;
+#endif
+};
+
+struct hakomari_cache_rule_s
+{
+	bool any_endpoint;
+	bool any_query;
+	// Rules from endpoint metadata are replaced on every enumeration
+	bool advertised;
+	uint32_t ttl_ms;
+	hakomari_string_t type;
+	hakomari_string_t name;
+	hakomari_string_t query;
+};
+
+struct hakomari_cache_hint_s
+{
+	hakomari_string_t query;
+	uint32_t ttl_ms;
+};
+
+struct hakomari_cache_entry_s
+{
+	struct hakomari_cache_entry_s* prev;
+	struct hakomari_cache_entry_s* next;
+	uint64_t hash;
+	uint64_t expires_at;
+	size_t key_size;
+	size_t value_size;
+	// Key followed by the result
+	uint8_t data[];
+};
+
+struct hakomari_cache_s
+{
+	size_t capacity;
+	size_t used;
+	uint32_t generation;
+	// Most recently used first
+	struct hakomari_cache_entry_s* head;
+	struct hakomari_cache_entry_s* tail;
+
+	struct hakomari_cache_rule_s* rules;
+	size_t num_rules;
+	size_t rules_capacity;
+
+	// Key of the missed query followed by its result as the caller reads it
+	struct hakomari_mem_stream_s pending;
+	bool recording;
+	uint64_t pending_hash;
+	size_t pending_key_size;
+	uint32_t pending_ttl_ms;
+	uint32_t pending_generation;
+	hakomari_input_t recorder;
+	struct hakomari_memory_input_s hit;
+};
+
 struct hakomari_device_s
 {
 	hakomari_ctx_t* ctx;
+	hakomari_allocator_t allocator;
+	struct hakomari_arena_s arena;
+	struct hakomari_pool_s prepared_query_pool;
+	bool static_storage;
 	struct sp_port* port;
 	uint32_t txid;
 	uint32_t num_endpoints;
+	uint32_t endpoints_capacity;
 	hakomari_endpoint_desc_t* endpoints;
+	uint32_t* endpoint_handles;
+	uint32_t endpoint_generation;
 	slipper_ctx_t slipper;
 	cmp_ctx_t cmp;
 	hakomari_input_t result;
 	hakomari_passphrase_screen_t passphrase_screen;
+	size_t passphrase_screen_size;
+	size_t passphrase_screen_capacity;
+	size_t upload_window;
+	uint8_t* upload_buf;
+	uint8_t* codec_buf;
+	struct hakomari_compressor_s compressor;
+	uint64_t passphrase_screen_hash;
+	bool passphrase_screen_cached;
 	struct hakomari_mem_stream_s payload_buff;
-
-	uint8_t io_buf[HAKOMARI_BUF_SIZE];
+	struct hakomari_cache_s cache;
+
+	bool caps_negotiated;
+	uint32_t caps;
+
+	bool adaptive;
+	bool lazy_drain;
+	unsigned int input_coalesce_ms;
+	size_t input_batch_size;
+	size_t batch_window;
+	bool drain_pending;
+	size_t max_buf_size;
+	size_t frame_size;
+	size_t io_buf_size;
+	uint8_t* io_buf;
+	size_t payload_chunk_size;
+	uint8_t* payload_chunk;
+	size_t rx_buf_size;
+	uint8_t* rx_buf;
+	size_t rx_size;
+	size_t rx_pos;
+	bool rx_complete;
+	bool rx_has_flags;
+	bool rx_compressed;
+	size_t rx_block_size;
+	size_t rx_block_pos;
+	size_t tx_size;
+	uint8_t tx_buf[HAKOMARI_TX_BUF_SIZE];
 };
 
+typedef char hakomari_ctx_fits_overhead[
+	sizeof(hakomari_ctx_t) <= HAKOMARI_CTX_OVERHEAD ? 1 : -1
+];
+typedef char hakomari_device_fits_overhead[
+	sizeof(hakomari_device_t) <= HAKOMARI_DEVICE_OVERHEAD ? 1 : -1
+];
+typedef char hakomari_input_fits_overhead[
+	sizeof(struct hakomari_memory_input_s) <= HAKOMARI_INPUT_OVERHEAD ? 1 : -1
+];
+typedef char hakomari_prepared_query_fits_overhead[
+	sizeof(struct hakomari_prepared_query_s) + 2 * HAKOMARI_TX_BUF_SIZE
+		<= HAKOMARI_PREPARED_QUERY_OVERHEAD ? 1 : -1
+];
+typedef char hakomari_pool_slots_aligned[
+	HAKOMARI_INPUT_OVERHEAD % HAKOMARI_STATIC_ALIGN == 0
+		&& HAKOMARI_PREPARED_QUERY_OVERHEAD % HAKOMARI_STATIC_ALIGN == 0 ? 1 : -1
+];
+typedef char hakomari_codec_fits_overhead[
+	HAKOMARI_CODEC_SIZE <= HAKOMARI_CODEC_OVERHEAD ? 1 : -1
+];
+typedef char hakomari_arena_block_fits_alignment[
+	sizeof(struct hakomari_arena_block_s) <= HAKOMARI_STATIC_ALIGN ? 1 : -1
+];
+
+static uint64_t
+hakomari_now_ms(void)
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static void*
+hakomari_std_realloc(void* userdata, void* ptr, size_t size)
+{
+	(void)userdata;
+
+	if(size == 0)
+	{
+		free(ptr);
+		return NULL;
+	}
+
+#ifdef HAKOMARI_STATIC_STORAGE
+	// Static storage builds never touch the heap
+	return NULL;
+#else
+	return realloc(ptr, size);
+#endif
+}
+
+static void
+hakomari_arena_init(struct hakomari_arena_s* arena, void* storage, size_t size)
+{
+	size_t padding = (size_t)(-(uintptr_t)storage & (HAKOMARI_STATIC_ALIGN - 1));
+	if(padding > size) { padding = size; }
+
+	*arena = (struct hakomari_arena_s){
+		.memory = (uint8_t*)storage + padding,
+		.size = size - padding,
+		.last = HAKOMARI_ARENA_NONE,
+	};
+}
+
+static void*
+hakomari_arena_realloc(void* userdata, void* ptr, size_t size)
+{
+	struct hakomari_arena_s* arena = userdata;
+	struct hakomari_arena_block_s* block = ptr != NULL
+		? (struct hakomari_arena_block_s*)((uint8_t*)ptr - HAKOMARI_STATIC_ALIGN)
+		: NULL;
+	bool is_last = true
+		&& block != NULL
+		&& arena->last != HAKOMARI_ARENA_NONE
+		&& (uint8_t*)block == arena->memory + arena->last;
+
+	if(size == 0)
+	{
+		// Only the most recent block can be given back
+		if(is_last)
+		{
+			arena->used = arena->last;
+			arena->last = block->prev;
+		}
+
+		return NULL;
+	}
+
+	size_t block_size = HAKOMARI_STATIC_BLOCK(size);
+	if(is_last)
+	{
+		// The most recent block is resized in place
+		if(block_size > arena->size - arena->last) { return NULL; }
+
+		block->size = size;
+		arena->used = arena->last + block_size;
+		return ptr;
+	}
+
+	if(block_size > arena->size - arena->used) { return NULL; }
+
+	struct hakomari_arena_block_s* new_block =
+		(struct hakomari_arena_block_s*)(arena->memory + arena->used);
+	*new_block = (struct hakomari_arena_block_s){
+		.size = size,
+		.prev = arena->last,
+	};
+	arena->last = arena->used;
+	arena->used += block_size;
+
+	void* new_ptr = (uint8_t*)new_block + HAKOMARI_STATIC_ALIGN;
+	if(block != NULL)
+	{
+		memcpy(new_ptr, ptr, block->size < size ? block->size : size);
+	}
+
+	return new_ptr;
+}
+
+static void
+hakomari_pool_init(
+	struct hakomari_pool_s* pool, void* memory, size_t slot_size, size_t num_slots
+)
+{
+	*pool = (struct hakomari_pool_s){
+		.memory = memory,
+		.slot_size = slot_size,
+	};
+	if(memory == NULL) { return; }
+
+	// Free slots are linked through their first bytes
+	for(size_t i = num_slots; i > 0; --i)
+	{
+		void** slot = (void**)(pool->memory + (i - 1) * slot_size);
+		*slot = pool->free_slots;
+		pool->free_slots = slot;
+	}
+}
+
+static void*
+hakomari_pool_alloc(struct hakomari_pool_s* pool, size_t size)
+{
+	void** slot = pool->free_slots;
+	if(slot == NULL || size > pool->slot_size) { return NULL; }
+
+	pool->free_slots = *slot;
+	return slot;
+}
+
+static void
+hakomari_pool_free(struct hakomari_pool_s* pool, void* ptr)
+{
+	if(ptr == NULL) { return; }
+
+	void** slot = ptr;
+	*slot = pool->free_slots;
+	pool->free_slots = slot;
+}
+
+static void
+hakomari_free_with(
+	hakomari_ctx_t* ctx, const hakomari_allocator_t* allocator, void* ptr
+)
+{
+	if(ptr == NULL) { return; }
+
+	++ctx->alloc_stats.num_frees;
+	allocator->realloc(allocator->userdata, ptr, 0);
+}
+
+static void*
+hakomari_realloc_with(
+	hakomari_ctx_t* ctx, const hakomari_allocator_t* allocator,
+	void* ptr, size_t size
+)
+{
+	if(size == 0)
+	{
+		hakomari_free_with(ctx, allocator, ptr);
+		return NULL;
+	}
+
+	++ctx->alloc_stats.num_allocs;
+	return allocator->realloc(allocator->userdata, ptr, size);
+}
+
+static void
+hakomari_free(hakomari_ctx_t* ctx, void* ptr)
+{
+	hakomari_free_with(ctx, &ctx->allocator, ptr);
+}
+
+static void*
+hakomari_realloc(hakomari_ctx_t* ctx, void* ptr, size_t size)
+{
+	return hakomari_realloc_with(ctx, &ctx->allocator, ptr, size);
+}
+
+static void*
+hakomari_malloc(hakomari_ctx_t* ctx, size_t size)
+{
+	return hakomari_realloc(ctx, NULL, size);
+}
+
+static void
+hakomari_device_free(hakomari_device_t* device, void* ptr)
+{
+	hakomari_free_with(device->ctx, &device->allocator, ptr);
+}
+
+static void*
+hakomari_device_realloc(hakomari_device_t* device, void* ptr, size_t size)
+{
+	return hakomari_realloc_with(device->ctx, &device->allocator, ptr, size);
+}
+
+static void*
+hakomari_device_malloc(hakomari_device_t* device, size_t size)
+{
+	return hakomari_device_realloc(device, NULL, size);
+}
+
 static const char*
 hakomari_errorstr(hakomari_error_t error)
 {
@@ -91,6 +683,8 @@ hakomari_errorstr(hakomari_error_t error)
 			return "IO error";
 		case HAKOMARI_ERR_MEMORY:
 			return "Out of memory";
+		case HAKOMARI_ERR_RETRY:
+			return "Query must be retried";
 		default:
 			return "Sum Ting Wong";
 	}
@@ -105,6 +699,18 @@ hakomari_set_last_error(
 	return ctx->last_error = error;
 }
 
+hakomari_error_t
+hakomari_get_alloc_stats(hakomari_ctx_t* ctx, hakomari_alloc_stats_t* stats)
+{
+	if(stats == NULL)
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	*stats = ctx->alloc_stats;
+	return hakomari_set_last_error(ctx, HAKOMARI_OK, NULL);
+}
+
 hakomari_error_t
 hakomari_get_last_error(hakomari_ctx_t* ctx, const char** error)
 {
@@ -117,10 +723,26 @@ hakomari_copy_sp_error(hakomari_ctx_t* ctx)
 {
 	char* error = sp_last_error_message();
 	size_t len = strlen(error);
-	ctx->copied_errorstr = realloc(ctx->copied_errorstr, len + 1);
-	memcpy(ctx->copied_errorstr, error, len + 1);
+	if(len + 1 > ctx->errorstr_capacity && !ctx->static_storage)
+	{
+		char* copied_errorstr = hakomari_realloc(ctx, ctx->copied_errorstr, len + 1);
+		if(copied_errorstr != NULL)
+		{
+			ctx->copied_errorstr = copied_errorstr;
+			ctx->errorstr_capacity = len + 1;
+		}
+	}
+
+	// Truncate rather than fail when the message does not fit
+	char* copied_errorstr = ctx->copied_errorstr;
+	if(copied_errorstr != NULL)
+	{
+		if(len + 1 > ctx->errorstr_capacity) { len = ctx->errorstr_capacity - 1; }
+		memcpy(copied_errorstr, error, len);
+		copied_errorstr[len] = '\0';
+	}
 	sp_free_error_message(error);
-	return ctx->copied_errorstr;
+	return copied_errorstr;
 }
 
 static hakomari_error_t
@@ -154,61 +776,140 @@ hakomari_set_sp_error(hakomari_ctx_t* ctx, enum sp_return error)
 	}
 }
 
-hakomari_error_t
-hakomari_create_context(hakomari_ctx_t** context_ptr)
+static hakomari_error_t
+hakomari_init_context(hakomari_ctx_t* ctx, hakomari_ctx_t** context_ptr)
 {
-	hakomari_ctx_t* ctx = calloc(1, sizeof(hakomari_ctx_t));
-	if(ctx == NULL) { return HAKOMARI_ERR_MEMORY; }
-
 	*context_ptr = ctx;
 
 	enum sp_return sp_error;
 	if((sp_error = sp_new_config(&ctx->port_config)) != SP_OK)
 	{
-		free(ctx);
+		hakomari_free(ctx, ctx);
 		return HAKOMARI_ERR_MEMORY;
 	}
 
 	if((sp_error = sp_set_config_baudrate(ctx->port_config, 115200)) != SP_OK)
 	{
-		free(ctx);
+		hakomari_free(ctx, ctx);
 		return HAKOMARI_ERR_IO;
 	}
 
 	if((sp_error = sp_set_config_bits(ctx->port_config, 8)) != SP_OK)
 	{
-		free(ctx);
+		hakomari_free(ctx, ctx);
 		return HAKOMARI_ERR_IO;
 	}
 
 	if((sp_error = sp_set_config_parity(ctx->port_config, SP_PARITY_NONE)) != SP_OK)
 	{
-		free(ctx);
+		hakomari_free(ctx, ctx);
 		return HAKOMARI_ERR_IO;
 	}
 
 	if((sp_error = sp_set_config_stopbits(ctx->port_config, 1)) != SP_OK)
 	{
-		free(ctx);
+		hakomari_free(ctx, ctx);
 		return HAKOMARI_ERR_IO;
 	}
 
 	if((sp_error = sp_set_config_flowcontrol(ctx->port_config, SP_FLOWCONTROL_RTSCTS)) != SP_OK)
 	{
-		free(ctx);
+		hakomari_free(ctx, ctx);
 		return HAKOMARI_ERR_IO;
 	}
 
 	return hakomari_set_last_error(ctx, HAKOMARI_OK, NULL);
 }
 
+hakomari_error_t
+hakomari_create_context(hakomari_ctx_t** context_ptr)
+{
+	return hakomari_create_context_ex(NULL, context_ptr);
+}
+
+hakomari_error_t
+hakomari_create_context_ex(
+	const hakomari_allocator_t* allocator, hakomari_ctx_t** context_ptr
+)
+{
+	if(allocator != NULL && allocator->realloc == NULL) { return HAKOMARI_ERR_INVALID; }
+
+	hakomari_allocator_t ctx_allocator = allocator != NULL
+		? *allocator
+		: (hakomari_allocator_t){ .realloc = hakomari_std_realloc };
+	hakomari_ctx_t* ctx = ctx_allocator.realloc(
+		ctx_allocator.userdata, NULL, sizeof(hakomari_ctx_t)
+	);
+	if(ctx == NULL) { return HAKOMARI_ERR_MEMORY; }
+
+	*ctx = (hakomari_ctx_t){
+		.allocator = ctx_allocator,
+		.alloc_stats = { .num_allocs = 1 },
+	};
+
+	return hakomari_init_context(ctx, context_ptr);
+}
+
+hakomari_error_t
+hakomari_create_context_static(
+	void* storage, size_t storage_size, hakomari_ctx_t** context_ptr
+)
+{
+	if(storage == NULL || context_ptr == NULL) { return HAKOMARI_ERR_INVALID; }
+
+	struct hakomari_arena_s arena;
+	hakomari_arena_init(&arena, storage, storage_size);
+	hakomari_ctx_t* ctx = hakomari_arena_realloc(
+		&arena, NULL, sizeof(hakomari_ctx_t)
+	);
+	if(ctx == NULL) { return HAKOMARI_ERR_MEMORY; }
+
+	*ctx = (hakomari_ctx_t){
+		.alloc_stats = { .num_allocs = 1 },
+		.arena = arena,
+		.static_storage = true,
+	};
+	ctx->allocator = (hakomari_allocator_t){
+		.userdata = &ctx->arena,
+		.realloc = hakomari_arena_realloc,
+	};
+
+	// Everything a context can grow is set aside up front
+	ctx->devices = hakomari_malloc(
+		ctx, HAKOMARI_STATIC_MAX_DEVICES * sizeof(hakomari_device_desc_t)
+	);
+	ctx->copied_errorstr = hakomari_malloc(ctx, HAKOMARI_STATIC_ERRORSTR_SIZE);
+
+	// Inputs come and go in any order, which an arena cannot reclaim
+	hakomari_pool_init(
+		&ctx->input_pool,
+		hakomari_malloc(
+			ctx, HAKOMARI_STATIC_MAX_INPUTS * HAKOMARI_INPUT_OVERHEAD
+		),
+		HAKOMARI_INPUT_OVERHEAD, HAKOMARI_STATIC_MAX_INPUTS
+	);
+	if(false
+		|| ctx->devices == NULL
+		|| ctx->copied_errorstr == NULL
+		|| (HAKOMARI_STATIC_MAX_INPUTS > 0 && ctx->input_pool.memory == NULL)
+	)
+	{
+		return HAKOMARI_ERR_MEMORY;
+	}
+	ctx->devices_capacity = HAKOMARI_STATIC_MAX_DEVICES;
+	ctx->errorstr_capacity = HAKOMARI_STATIC_ERRORSTR_SIZE;
+
+	return hakomari_init_context(ctx, context_ptr);
+}
+
 void
 hakomari_destroy_context(hakomari_ctx_t* context)
 {
 	sp_free_config(context->port_config);
-	if(context->copied_errorstr) { free(context->copied_errorstr); }
-	if(context->devices) { free(context->devices); }
-	free(context);
+	hakomari_free(context, context->input_pool.memory);
+	hakomari_free(context, context->copied_errorstr);
+	hakomari_free(context, context->devices);
+	hakomari_free(context, context);
 }
 
 static bool
@@ -237,12 +938,29 @@ hakomari_enumerate_ports(
 		++ctx->num_devices;
 	}
 
-	*num_devices = ctx->num_devices;
-	ctx->devices = realloc(ctx->devices, sizeof(*ctx->devices) * ctx->num_devices);
-	if(ctx->devices == NULL)
+	if(ctx->num_devices > ctx->devices_capacity)
 	{
-		return hakomari_set_last_error(ctx, HAKOMARI_ERR_MEMORY, NULL);
+		if(ctx->static_storage)
+		{
+			ctx->num_devices = 0;
+			return hakomari_set_last_error(
+				ctx, HAKOMARI_ERR_MEMORY, "Too many devices"
+			);
+		}
+
+		hakomari_device_desc_t* devices = hakomari_realloc(
+			ctx, ctx->devices, sizeof(*ctx->devices) * ctx->num_devices
+		);
+		if(devices == NULL)
+		{
+			ctx->num_devices = 0;
+			return hakomari_set_last_error(ctx, HAKOMARI_ERR_MEMORY, NULL);
+		}
+
+		ctx->devices = devices;
+		ctx->devices_capacity = ctx->num_devices;
 	}
+	*num_devices = ctx->num_devices;
 
 	unsigned int device_index = 0;
 	for(struct sp_port** itr = ports; *itr != NULL; ++itr)
@@ -302,49 +1020,433 @@ hakomari_inspect_device(
 	return hakomari_set_last_error(ctx, HAKOMARI_OK, NULL);
 }
 
-static bool
-hakomari_cmp_read(cmp_ctx_t* ctx, void* data, size_t limit)
+static inline uint32_t
+hakomari_load32(const uint8_t* data)
 {
-	hakomari_device_t* device = ctx->buf;
-	size_t bytes_read = limit;
-	return slipper_read(
-		&device->slipper, data, &bytes_read, HAKOMARI_DEVICE_TIMEOUT
-	) == SLIPPER_OK && bytes_read == limit;
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
 }
 
-static size_t
-hakomari_cmp_write(cmp_ctx_t* ctx, const void* data, size_t count)
+static uint8_t*
+hakomari_lz_write_length(uint8_t* out, size_t length)
 {
-	hakomari_device_t* device = ctx->buf;
-	return slipper_write(
-		&device->slipper, data, count, HAKOMARI_DEVICE_TIMEOUT
-	) == SLIPPER_OK ? count : 0;
+	for(; length >= 255; length -= 255) { *out++ = 255; }
+	*out++ = (uint8_t)length;
+	return out;
 }
 
-static void
-hakomari_reset_cmp(hakomari_device_t* device)
+static uint8_t*
+hakomari_lz_write_sequence(
+	uint8_t* out, const uint8_t* out_end,
+	const uint8_t* literals, size_t num_literals,
+	size_t offset, size_t match_length
+)
 {
-	cmp_init(&device->cmp, device, hakomari_cmp_read, NULL, hakomari_cmp_write);
+	// Token, extra length bytes, literals and offset
+	size_t max_size = 1
+		+ num_literals / 255 + 1
+		+ num_literals
+		+ 2
+		+ match_length / 255 + 1;
+	if(max_size > (size_t)(out_end - out)) { return NULL; }
+
+	size_t extra_match = match_length > 0 ? match_length - HAKOMARI_LZ_MIN_MATCH : 0;
+	*out++ = (uint8_t)(
+		(num_literals < 15 ? num_literals : 15) << 4
+		| (extra_match < 15 ? extra_match : 15)
+	);
+	if(num_literals >= 15) { out = hakomari_lz_write_length(out, num_literals - 15); }
+
+	memcpy(out, literals, num_literals);
+	out += num_literals;
+
+	// The last sequence only has literals
+	if(match_length == 0) { return out; }
+
+	*out++ = (uint8_t)offset;
+	*out++ = (uint8_t)(offset >> 8);
+	if(extra_match >= 15) { out = hakomari_lz_write_length(out, extra_match - 15); }
+
+	return out;
 }
 
-static slipper_error_t
-hakomari_serial_write(
-	void* userdata,
-	const void* data, size_t size,
-	bool flush, slipper_timeout_t timeout
+/*
+ * Compress a block of at most HAKOMARI_COMPRESSION_BLOCK_SIZE bytes in the
+ * LZ4 block format so that devices can use any LZ4 decoder.
+ * Return 0 when the result does not fit in capacity.
+ */
+static size_t
+hakomari_lz_compress(
+	const uint8_t* src, size_t size, uint8_t* dst, size_t capacity,
+	uint16_t* table
 )
 {
-	hakomari_device_t* device = userdata;
-	hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	uint8_t* out = dst;
+	const uint8_t* out_end = dst + capacity;
+	size_t anchor = 0;
 
-	enum sp_return error;
-	if((error = sp_blocking_write(device->port, data, size, timeout) <= 0))
+	if(size > HAKOMARI_LZ_MATCH_LIMIT)
 	{
-		hakomari_set_sp_error(device->ctx, error);
-		return SLIPPER_ERR_IO;
+		memset(table, 0, HAKOMARI_CODEC_TABLE_SIZE);
+
+		size_t match_limit = size - HAKOMARI_LZ_MATCH_LIMIT;
+		size_t length_limit = size - HAKOMARI_LZ_LAST_LITERALS;
+		size_t pos = 0;
+		while(pos < match_limit)
+		{
+			uint32_t sequence = hakomari_load32(src + pos);
+			uint32_t hash = (sequence * 2654435761u) >> (32 - HAKOMARI_LZ_HASH_BITS);
+			size_t candidate = table[hash];
+			table[hash] = (uint16_t)pos;
+
+			if(candidate >= pos || hakomari_load32(src + candidate) != sequence)
+			{
+				// Skip ahead faster the longer nothing matches
+				pos += 1 + ((pos - anchor) >> 6);
+				continue;
+			}
+
+			size_t match_length = HAKOMARI_LZ_MIN_MATCH;
+			while(true
+				&& pos + match_length < length_limit
+				&& src[candidate + match_length] == src[pos + match_length]
+			)
+			{
+				++match_length;
+			}
+
+			out = hakomari_lz_write_sequence(
+				out, out_end, src + anchor, pos - anchor,
+				pos - candidate, match_length
+			);
+			if(out == NULL) { return 0; }
+
+			pos += match_length;
+			anchor = pos;
+		}
+	}
+
+	out = hakomari_lz_write_sequence(
+		out, out_end, src + anchor, size - anchor, 0, 0
+	);
+	return out != NULL ? (size_t)(out - dst) : 0;
+}
+
+static bool
+hakomari_lz_read_length(
+	const uint8_t** in, const uint8_t* in_end, size_t* length
+)
+{
+	uint8_t byte;
+	do
+	{
+		if(*in == in_end) { return false; }
+
+		byte = *(*in)++;
+		*length += byte;
+	} while(byte == 255);
+
+	return true;
+}
+
+/*
+ * Decompress a LZ4 block into at most capacity bytes.
+ * Return false on malformed input.
+ */
+static bool
+hakomari_lz_decompress(
+	const uint8_t* src, size_t size, uint8_t* dst, size_t* capacity
+)
+{
+	const uint8_t* in = src;
+	const uint8_t* in_end = src + size;
+	uint8_t* out = dst;
+	uint8_t* out_end = dst + *capacity;
+
+	while(in < in_end)
+	{
+		uint8_t token = *in++;
+
+		size_t num_literals = token >> 4;
+		if(num_literals == 15 && !hakomari_lz_read_length(&in, in_end, &num_literals))
+		{
+			return false;
+		}
+
+		if(false
+			|| num_literals > (size_t)(in_end - in)
+			|| num_literals > (size_t)(out_end - out)
+		)
+		{
+			return false;
+		}
+
+		memcpy(out, in, num_literals);
+		in += num_literals;
+		out += num_literals;
+
+		if(in == in_end) { break; }
+		if(in_end - in < 2) { return false; }
+
+		size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+		in += 2;
+
+		size_t match_length = token & 15;
+		if(match_length == 15 && !hakomari_lz_read_length(&in, in_end, &match_length))
+		{
+			return false;
+		}
+		match_length += HAKOMARI_LZ_MIN_MATCH;
+
+		if(false
+			|| offset == 0
+			|| offset > (size_t)(out - dst)
+			|| match_length > (size_t)(out_end - out)
+		)
+		{
+			return false;
+		}
+
+		// Matches may overlap what they produce
+		const uint8_t* match = out - offset;
+		if(offset >= match_length)
+		{
+			memcpy(out, match, match_length);
+			out += match_length;
+		}
+		else
+		{
+			for(size_t i = 0; i < match_length; ++i) { *out++ = *match++; }
+		}
+	}
+
+	*capacity = (size_t)(out - dst);
+	return true;
+}
+
+static inline uint8_t*
+hakomari_codec_raw_block(hakomari_device_t* device)
+{
+	return device->codec_buf + HAKOMARI_CODEC_TABLE_SIZE;
+}
+
+static inline uint8_t*
+hakomari_codec_encoded_block(hakomari_device_t* device)
+{
+	return hakomari_codec_raw_block(device) + HAKOMARI_COMPRESSION_BLOCK_SIZE;
+}
+
+static inline uint8_t*
+hakomari_codec_decoded_block(hakomari_device_t* device)
+{
+	return hakomari_codec_encoded_block(device)
+		+ HAKOMARI_COMPRESSION_BLOCK_SIZE + HAKOMARI_BLOCK_HEADER_SIZE;
+}
+
+static slipper_error_t
+hakomari_rx_read_raw(hakomari_device_t* device, void* buf, size_t* size)
+{
+	size_t num_buffered = device->rx_size - device->rx_pos;
+	size_t bytes_read = num_buffered < *size ? num_buffered : *size;
+	if(bytes_read > 0)
+	{
+		memcpy(buf, device->rx_buf + device->rx_pos, bytes_read);
+		device->rx_pos += bytes_read;
+	}
+
+	if(bytes_read == *size || device->rx_complete)
+	{
+		*size = bytes_read;
+		return SLIPPER_OK;
+	}
+
+	// The rest of a frame larger than the buffer streams from slipper
+	size_t num_remaining = *size - bytes_read;
+	slipper_error_t error = slipper_read(
+		&device->slipper, (uint8_t*)buf + bytes_read, &num_remaining,
+		HAKOMARI_DEVICE_TIMEOUT
+	);
+	*size = bytes_read + num_remaining;
+	return error;
+}
+
+static slipper_error_t
+hakomari_rx_read_block(hakomari_device_t* device, bool* end)
+{
+	uint8_t header[HAKOMARI_BLOCK_HEADER_SIZE];
+	size_t header_size = sizeof(header);
+	slipper_error_t error;
+	if((error = hakomari_rx_read_raw(device, header, &header_size)) != SLIPPER_OK)
+	{
+		return error;
+	}
+
+	*end = header_size == 0;
+	if(*end) { return SLIPPER_OK; }
+
+	uint16_t block_header = (uint16_t)(header[0] << 8 | header[1]);
+	size_t block_size = block_header & ~HAKOMARI_BLOCK_STORED;
+	if(header_size != sizeof(header) || block_size > HAKOMARI_COMPRESSION_BLOCK_SIZE)
+	{
+		return SLIPPER_ERR_ENCODING;
+	}
+
+	// A stored block is read as is, others go through the encoded buffer
+	bool stored = (block_header & HAKOMARI_BLOCK_STORED) != 0;
+	uint8_t* decoded = hakomari_codec_decoded_block(device);
+	uint8_t* encoded = stored ? decoded : hakomari_codec_encoded_block(device);
+	size_t encoded_size = block_size;
+	if((error = hakomari_rx_read_raw(device, encoded, &encoded_size)) != SLIPPER_OK)
+	{
+		return error;
+	}
+
+	size_t decoded_size = HAKOMARI_COMPRESSION_BLOCK_SIZE;
+	if(false
+		|| encoded_size != block_size
+		|| (!stored && !hakomari_lz_decompress(
+			encoded, encoded_size, decoded, &decoded_size
+		))
+	)
+	{
+		return SLIPPER_ERR_ENCODING;
+	}
+
+	device->rx_block_size = stored ? block_size : decoded_size;
+	device->rx_block_pos = 0;
+	return SLIPPER_OK;
+}
+
+static inline bool
+hakomari_rx_exhausted(hakomari_device_t* device)
+{
+	return true
+		&& device->rx_complete
+		&& device->rx_pos == device->rx_size
+		&& device->rx_block_pos == device->rx_block_size;
+}
+
+static slipper_error_t
+hakomari_rx_read(hakomari_device_t* device, void* buf, size_t* size)
+{
+	if(!device->rx_compressed) { return hakomari_rx_read_raw(device, buf, size); }
+
+	uint8_t* read_buf = buf;
+	size_t bytes_read = 0;
+	while(bytes_read < *size)
+	{
+		if(device->rx_block_pos == device->rx_block_size)
+		{
+			bool end;
+			slipper_error_t error;
+			if((error = hakomari_rx_read_block(device, &end)) != SLIPPER_OK)
+			{
+				return error;
+			}
+
+			if(end) { break; }
+			continue;
+		}
+
+		size_t num_buffered = device->rx_block_size - device->rx_block_pos;
+		size_t num_copied = *size - bytes_read;
+		if(num_buffered < num_copied) { num_copied = num_buffered; }
+
+		memcpy(
+			read_buf + bytes_read,
+			hakomari_codec_decoded_block(device) + device->rx_block_pos,
+			num_copied
+		);
+		device->rx_block_pos += num_copied;
+		bytes_read += num_copied;
+	}
+
+	*size = bytes_read;
+	return SLIPPER_OK;
+}
+
+static bool
+hakomari_cmp_read(cmp_ctx_t* ctx, void* data, size_t limit)
+{
+	hakomari_device_t* device = ctx->buf;
+	size_t bytes_read = limit;
+	return hakomari_rx_read(device, data, &bytes_read) == SLIPPER_OK
+		&& bytes_read == limit;
+}
+
+static slipper_error_t
+hakomari_flush_request(hakomari_device_t* device)
+{
+	size_t size = device->tx_size;
+	device->tx_size = 0;
+	if(size == 0) { return SLIPPER_OK; }
+
+	// One escape pass over everything serialized so far
+	return slipper_write(
+		&device->slipper, device->tx_buf, size, HAKOMARI_DEVICE_TIMEOUT
+	);
+}
+
+static slipper_error_t
+hakomari_flush_output(hakomari_device_t* device)
+{
+	slipper_error_t error;
+	if((error = hakomari_flush_request(device)) != SLIPPER_OK) { return error; }
+
+	return slipper_flush(&device->slipper, HAKOMARI_DEVICE_TIMEOUT);
+}
+
+static size_t
+hakomari_cmp_write(cmp_ctx_t* ctx, const void* data, size_t count)
+{
+	hakomari_device_t* device = ctx->buf;
+	if(count > sizeof(device->tx_buf) - device->tx_size)
+	{
+		if(hakomari_flush_request(device) != SLIPPER_OK) { return 0; }
+
+		if(count > sizeof(device->tx_buf))
+		{
+			return slipper_write(
+				&device->slipper, data, count, HAKOMARI_DEVICE_TIMEOUT
+			) == SLIPPER_OK ? count : 0;
+		}
+	}
+
+	memcpy(device->tx_buf + device->tx_size, data, count);
+	device->tx_size += count;
+	return count;
+}
+
+static void
+hakomari_reset_cmp(hakomari_device_t* device)
+{
+	cmp_init(&device->cmp, device, hakomari_cmp_read, NULL, hakomari_cmp_write);
+}
+
+static slipper_error_t
+hakomari_serial_write(
+	void* userdata,
+	const void* data, size_t size,
+	bool flush, slipper_timeout_t timeout
+)
+{
+	hakomari_device_t* device = userdata;
+	hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	device->frame_size += size;
+
+	enum sp_return error;
+	if((error = sp_blocking_write(device->port, data, size, timeout) <= 0))
+	{
+		hakomari_set_sp_error(device->ctx, error);
+		return SLIPPER_ERR_IO;
 	}
 
-	if(flush && (error = sp_drain(device->port)) != 0)
+	if(flush && device->lazy_drain)
+	{
+		device->drain_pending = true;
+	}
+	else if(flush && (error = sp_drain(device->port)) != 0)
 	{
 		hakomari_set_sp_error(device->ctx, error);
 		return SLIPPER_ERR_IO;
@@ -353,6 +1455,22 @@ hakomari_serial_write(
 	return SLIPPER_OK;
 }
 
+static hakomari_error_t
+hakomari_drain(hakomari_device_t* device)
+{
+	if(!device->drain_pending) { return HAKOMARI_OK; }
+
+	device->drain_pending = false;
+
+	enum sp_return error;
+	if((error = sp_drain(device->port)) != SP_OK)
+	{
+		return hakomari_set_sp_error(device->ctx, error);
+	}
+
+	return HAKOMARI_OK;
+}
+
 static slipper_error_t
 hakomari_serial_read(
 	void* userdata,
@@ -379,6 +1497,7 @@ hakomari_serial_read(
 	}
 
 	*size = bytes_read;
+	device->frame_size += bytes_read;
 	return SLIPPER_OK;
 }
 
@@ -386,7 +1505,7 @@ static hakomari_error_t
 hakomari_device_read(void* userdata, void* buf, size_t* size)
 {
 	hakomari_device_t* device = userdata;
-	switch(slipper_read(&device->slipper, buf, size, HAKOMARI_DEVICE_TIMEOUT))
+	switch(hakomari_rx_read(device, buf, size))
 	{
 		case SLIPPER_OK:
 			return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
@@ -417,13 +1536,60 @@ hakomari_mem_stream_read(void* userdata, void* buf, size_t* size)
 	return HAKOMARI_OK;
 }
 
+static hakomari_error_t
+hakomari_mem_stream_rewind(void* userdata)
+{
+	struct hakomari_mem_stream_s* mem_stream = userdata;
+	mem_stream->read_pos = 0;
+
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_mem_stream_peek(void* userdata, const void** data, size_t* size)
+{
+	struct hakomari_mem_stream_s* mem_stream = userdata;
+	*data = mem_stream->buff + mem_stream->read_pos;
+	*size = mem_stream->write_pos - mem_stream->read_pos;
+
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_mem_stream_consume(void* userdata, size_t size)
+{
+	struct hakomari_mem_stream_s* mem_stream = userdata;
+	if(size > mem_stream->write_pos - mem_stream->read_pos) { return HAKOMARI_ERR_INVALID; }
+
+	mem_stream->read_pos += size;
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_mem_stream_size(void* userdata, uint64_t* size)
+{
+	struct hakomari_mem_stream_s* mem_stream = userdata;
+	*size = mem_stream->write_pos;
+
+	return HAKOMARI_OK;
+}
+
 static void
-hakomari_mem_stream_init(struct hakomari_mem_stream_s* mem_stream)
+hakomari_mem_stream_init(
+	struct hakomari_mem_stream_s* mem_stream,
+	hakomari_device_t* device, size_t max_size
+)
 {
 	*mem_stream = (struct hakomari_mem_stream_s){
+		.device = device,
+		.max_size = max_size,
 		.input = {
 			.userdata = mem_stream,
-			.read = hakomari_mem_stream_read
+			.read = hakomari_mem_stream_read,
+			.rewind = hakomari_mem_stream_rewind,
+			.size = hakomari_mem_stream_size,
+			.peek = hakomari_mem_stream_peek,
+			.consume = hakomari_mem_stream_consume,
 		}
 	};
 }
@@ -431,13 +1597,14 @@ hakomari_mem_stream_init(struct hakomari_mem_stream_s* mem_stream)
 static void
 hakomari_mem_stream_cleanup(struct hakomari_mem_stream_s* mem_stream)
 {
-	free(mem_stream->buff);
+	hakomari_device_free(mem_stream->device, mem_stream->buff);
 }
 
 static void
 hakomari_mem_stream_reset(struct hakomari_mem_stream_s* mem_stream)
 {
 	mem_stream->write_pos = 0;
+	mem_stream->overflowed = false;
 }
 
 static hakomari_input_t*
@@ -447,18 +1614,55 @@ hakomari_mem_stream_as_input(struct hakomari_mem_stream_s* mem_stream)
 	return &mem_stream->input;
 }
 
+static bool
+hakomari_mem_stream_reserve(struct hakomari_mem_stream_s* mem_stream, size_t size)
+{
+	if(mem_stream->max_size > 0 && size > mem_stream->max_size)
+	{
+		size = mem_stream->max_size;
+	}
+	if(size <= mem_stream->capacity) { return true; }
+
+	char* buff = hakomari_device_realloc(mem_stream->device, mem_stream->buff, size);
+	if(buff == NULL) { return false; }
+
+	mem_stream->buff = buff;
+	mem_stream->capacity = size;
+	return true;
+}
+
 static bool
 hakomari_mem_stream_write(
-	struct hakomari_mem_stream_s* mem_stream, void* buf, size_t size
+	struct hakomari_mem_stream_s* mem_stream, const void* buf, size_t size
 )
 {
+	if(mem_stream->overflowed) { return true; }
+
 	size_t required_capacity = mem_stream->write_pos + size;
+	if(mem_stream->max_size > 0 && required_capacity > mem_stream->max_size)
+	{
+		// Stop recording instead of growing past the bound
+		mem_stream->overflowed = true;
+		return true;
+	}
+
 	if(required_capacity > mem_stream->capacity)
 	{
-		mem_stream->buff = realloc(mem_stream->buff, required_capacity);
-		if(mem_stream->buff == NULL) { return false; }
+		// Grow geometrically to keep large payloads linear
+		size_t capacity = mem_stream->capacity * 2;
+		if(capacity < required_capacity) { capacity = required_capacity; }
+		if(mem_stream->max_size > 0 && capacity > mem_stream->max_size)
+		{
+			capacity = mem_stream->max_size;
+		}
 
-		mem_stream->capacity = required_capacity;
+		char* buff = hakomari_device_realloc(
+			mem_stream->device, mem_stream->buff, capacity
+		);
+		if(buff == NULL) { return false; }
+
+		mem_stream->buff = buff;
+		mem_stream->capacity = capacity;
 	}
 
 	if(size > 0) { memcpy(mem_stream->buff + mem_stream->write_pos, buf, size); }
@@ -466,19 +1670,486 @@ hakomari_mem_stream_write(
 	return true;
 }
 
-hakomari_error_t
-hakomari_open_device(
-	hakomari_ctx_t* ctx, size_t index, hakomari_device_t** device_ptr
-)
+static hakomari_error_t
+hakomari_memory_input_read(void* userdata, void* buf, size_t* size)
 {
-	if(index > ctx->num_devices || device_ptr == NULL)
+	struct hakomari_memory_input_s* memory_input = userdata;
+	size_t available_bytes = memory_input->size - memory_input->pos;
+	size_t bytes_to_read = available_bytes < *size ? available_bytes : *size;
+	if(bytes_to_read > 0)
 	{
-		return hakomari_set_last_error(ctx, HAKOMARI_ERR_INVALID, NULL);
+		memcpy(buf, memory_input->data + memory_input->pos, bytes_to_read);
 	}
+	memory_input->pos += bytes_to_read;
+	*size = bytes_to_read;
 
-	hakomari_device_desc_t* desc = &ctx->devices[index];
+	return HAKOMARI_OK;
+}
 
-	enum sp_return error;
+static hakomari_error_t
+hakomari_memory_input_rewind(void* userdata)
+{
+	struct hakomari_memory_input_s* memory_input = userdata;
+	memory_input->pos = 0;
+
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_memory_input_peek(void* userdata, const void** data, size_t* size)
+{
+	struct hakomari_memory_input_s* memory_input = userdata;
+	*data = memory_input->data + memory_input->pos;
+	*size = memory_input->size - memory_input->pos;
+
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_memory_input_consume(void* userdata, size_t size)
+{
+	struct hakomari_memory_input_s* memory_input = userdata;
+	if(size > memory_input->size - memory_input->pos) { return HAKOMARI_ERR_INVALID; }
+
+	memory_input->pos += size;
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_memory_input_size(void* userdata, uint64_t* size)
+{
+	struct hakomari_memory_input_s* memory_input = userdata;
+	*size = memory_input->size;
+
+	return HAKOMARI_OK;
+}
+
+static void
+hakomari_init_memory_input(
+	struct hakomari_memory_input_s* memory_input,
+	hakomari_ctx_t* ctx, const void* data, size_t size
+)
+{
+	*memory_input = (struct hakomari_memory_input_s){
+		.input = {
+			.userdata = memory_input,
+			.read = hakomari_memory_input_read,
+			.rewind = hakomari_memory_input_rewind,
+			.size = hakomari_memory_input_size,
+			.peek = hakomari_memory_input_peek,
+			.consume = hakomari_memory_input_consume,
+		},
+		.data = data,
+		.size = size,
+		.ctx = ctx,
+	};
+}
+
+static struct hakomari_memory_input_s*
+hakomari_create_memory_input(hakomari_ctx_t* ctx, const void* data, size_t size)
+{
+	struct hakomari_memory_input_s* memory_input = ctx->static_storage
+		? hakomari_pool_alloc(
+			&ctx->input_pool, sizeof(struct hakomari_memory_input_s)
+		)
+		: hakomari_malloc(ctx, sizeof(struct hakomari_memory_input_s));
+	if(memory_input == NULL) { return NULL; }
+
+	hakomari_init_memory_input(memory_input, ctx, data, size);
+	return memory_input;
+}
+
+hakomari_error_t
+hakomari_input_from_memory(
+	hakomari_ctx_t* ctx, const void* data, size_t size, hakomari_input_t** input
+)
+{
+	if(input == NULL || (data == NULL && size > 0))
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	struct hakomari_memory_input_s* memory_input =
+		hakomari_create_memory_input(ctx, data, size);
+	if(memory_input == NULL)
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_MEMORY, NULL);
+	}
+
+	*input = &memory_input->input;
+	return hakomari_set_last_error(ctx, HAKOMARI_OK, NULL);
+}
+
+hakomari_error_t
+hakomari_input_from_file(hakomari_ctx_t* ctx, int fd, hakomari_input_t** input)
+{
+	if(input == NULL)
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+#ifdef _WIN32
+	HANDLE file = (HANDLE)_get_osfhandle(fd);
+	LARGE_INTEGER file_size;
+	if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size))
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_INVALID, "Not a file");
+	}
+
+	size_t size = (size_t)file_size.QuadPart;
+	HANDLE mapping = NULL;
+	const void* data = NULL;
+	if(size > 0)
+	{
+		mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		data = mapping != NULL
+			? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)
+			: NULL;
+		if(data == NULL)
+		{
+			if(mapping != NULL) { CloseHandle(mapping); }
+			return hakomari_set_last_error(ctx, HAKOMARI_ERR_IO, "Could not map file");
+		}
+	}
+#else
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		return hakomari_set_last_error(
+			ctx, HAKOMARI_ERR_INVALID, "Not a regular file"
+		);
+	}
+
+	size_t size = (size_t)st.st_size;
+	const void* data = NULL;
+	if(size > 0)
+	{
+		void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapping == MAP_FAILED)
+		{
+			return hakomari_set_last_error(ctx, HAKOMARI_ERR_IO, "Could not map file");
+		}
+
+		posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
+		data = mapping;
+	}
+#endif
+
+	struct hakomari_memory_input_s* memory_input =
+		hakomari_create_memory_input(ctx, data, size);
+	if(memory_input == NULL)
+	{
+#ifdef _WIN32
+		if(data != NULL) { UnmapViewOfFile(data); CloseHandle(mapping); }
+#else
+		if(data != NULL) { munmap((void*)data, size); }
+#endif
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_MEMORY, NULL);
+	}
+
+	memory_input->mapped = data != NULL;
+#ifdef _WIN32
+	memory_input->mapping = mapping;
+#endif
+
+	*input = &memory_input->input;
+	return hakomari_set_last_error(ctx, HAKOMARI_OK, NULL);
+}
+
+void
+hakomari_destroy_input(hakomari_input_t* input)
+{
+	struct hakomari_memory_input_s* memory_input = input->userdata;
+	if(memory_input->mapped)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(memory_input->data);
+		CloseHandle(memory_input->mapping);
+#else
+		munmap((void*)memory_input->data, memory_input->size);
+#endif
+	}
+
+	hakomari_ctx_t* ctx = memory_input->ctx;
+	if(ctx->static_storage)
+	{
+		hakomari_pool_free(&ctx->input_pool, memory_input);
+	}
+	else
+	{
+		hakomari_free(ctx, memory_input);
+	}
+}
+
+static void
+hakomari_cache_unlink(
+	struct hakomari_cache_s* cache, struct hakomari_cache_entry_s* entry
+)
+{
+	if(entry->prev != NULL) { entry->prev->next = entry->next; }
+	else { cache->head = entry->next; }
+
+	if(entry->next != NULL) { entry->next->prev = entry->prev; }
+	else { cache->tail = entry->prev; }
+}
+
+static void
+hakomari_cache_push_front(
+	struct hakomari_cache_s* cache, struct hakomari_cache_entry_s* entry
+)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if(cache->head != NULL) { cache->head->prev = entry; }
+	else { cache->tail = entry; }
+	cache->head = entry;
+}
+
+static void
+hakomari_cache_remove(
+	hakomari_device_t* device, struct hakomari_cache_entry_s* entry
+)
+{
+	hakomari_cache_unlink(&device->cache, entry);
+	device->cache.used -= sizeof(*entry) + entry->key_size + entry->value_size;
+	hakomari_device_free(device, entry);
+}
+
+static void
+hakomari_cache_flush(hakomari_device_t* device)
+{
+	while(device->cache.head != NULL)
+	{
+		hakomari_cache_remove(device, device->cache.head);
+	}
+}
+
+static bool
+hakomari_add_cache_rule(
+	hakomari_device_t* device, const struct hakomari_cache_rule_s* rule
+)
+{
+	struct hakomari_cache_s* cache = &device->cache;
+
+	// A rule for the same endpoint and query is replaced
+	for(size_t i = 0; i < cache->num_rules; ++i)
+	{
+		struct hakomari_cache_rule_s* existing = &cache->rules[i];
+		if(true
+			&& existing->advertised == rule->advertised
+			&& existing->any_endpoint == rule->any_endpoint
+			&& existing->any_query == rule->any_query
+			&& strcmp(existing->type, rule->type) == 0
+			&& strcmp(existing->name, rule->name) == 0
+			&& strcmp(existing->query, rule->query) == 0
+		)
+		{
+			*existing = *rule;
+			return true;
+		}
+	}
+
+	if(cache->num_rules == cache->rules_capacity)
+	{
+		size_t capacity = cache->rules_capacity > 0 ? cache->rules_capacity * 2 : 4;
+		struct hakomari_cache_rule_s* rules = hakomari_device_realloc(
+			device, cache->rules, capacity * sizeof(struct hakomari_cache_rule_s)
+		);
+		if(rules == NULL) { return false; }
+
+		cache->rules = rules;
+		cache->rules_capacity = capacity;
+	}
+
+	cache->rules[cache->num_rules++] = *rule;
+	return true;
+}
+
+static void
+hakomari_add_advertised_cache_rules(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const struct hakomari_cache_hint_s* hints, uint32_t num_hints
+)
+{
+	for(uint32_t i = 0; i < num_hints; ++i)
+	{
+		struct hakomari_cache_rule_s rule = {
+			.advertised = true,
+			.ttl_ms = hints[i].ttl_ms,
+		};
+		memcpy(rule.type, desc->type, sizeof(rule.type));
+		memcpy(rule.name, desc->name, sizeof(rule.name));
+		memcpy(rule.query, hints[i].query, sizeof(rule.query));
+
+		// Without memory for the rule, the query is simply not cached
+		hakomari_add_cache_rule(device, &rule);
+	}
+}
+
+static void
+hakomari_drop_advertised_cache_rules(hakomari_device_t* device)
+{
+	struct hakomari_cache_s* cache = &device->cache;
+	size_t num_kept = 0;
+	for(size_t i = 0; i < cache->num_rules; ++i)
+	{
+		if(!cache->rules[i].advertised)
+		{
+			cache->rules[num_kept++] = cache->rules[i];
+		}
+	}
+
+	cache->num_rules = num_kept;
+}
+
+static bool
+hakomari_cache_ttl(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const char* query, uint32_t* ttl_ms
+)
+{
+	struct hakomari_cache_s* cache = &device->cache;
+
+	// The library's own queries are never cached
+	if(cache->capacity == 0 || query[0] == '@') { return false; }
+
+	// Explicit rules win over advertised ones, then the most specific
+	int best_score = -1;
+	for(size_t i = 0; i < cache->num_rules; ++i)
+	{
+		const struct hakomari_cache_rule_s* rule = &cache->rules[i];
+		bool matches = true
+			&& (rule->any_endpoint || (true
+				&& desc != NULL
+				&& strcmp(rule->type, desc->type) == 0
+				&& strcmp(rule->name, desc->name) == 0
+			))
+			&& (rule->any_query || strcmp(rule->query, query) == 0);
+		int score = (rule->advertised ? 0 : 4)
+			+ (rule->any_endpoint ? 0 : 2)
+			+ (rule->any_query ? 0 : 1);
+		if(matches && score > best_score)
+		{
+			best_score = score;
+			*ttl_ms = rule->ttl_ms;
+		}
+	}
+
+	return best_score >= 0 && *ttl_ms > 0;
+}
+
+static void
+hakomari_cache_cleanup(hakomari_device_t* device)
+{
+	hakomari_cache_flush(device);
+	hakomari_mem_stream_cleanup(&device->cache.pending);
+	hakomari_device_free(device, device->cache.rules);
+}
+
+static size_t
+hakomari_adaptive_size(
+	hakomari_device_t* device, size_t current_size, size_t observed_size
+)
+{
+	if(!device->adaptive || observed_size <= current_size) { return current_size; }
+
+	size_t size = current_size;
+	while(size < observed_size && size < device->max_buf_size) { size *= 2; }
+
+	return size < device->max_buf_size ? size : device->max_buf_size;
+}
+
+static void
+hakomari_grow_io_buf(hakomari_device_t* device, size_t observed_size)
+{
+	size_t size = hakomari_adaptive_size(
+		device, device->io_buf_size, observed_size
+	);
+	if(size == device->io_buf_size) { return; }
+
+	// realloc preserves buffered bytes so slipper's cursor stays valid.
+	// Growth is best-effort: keep the old buffer on failure.
+	uint8_t* io_buf = hakomari_device_realloc(device, device->io_buf, size);
+	if(io_buf == NULL) { return; }
+
+	device->io_buf = io_buf;
+	device->io_buf_size = size;
+	device->slipper.cfg.memory = io_buf;
+	device->slipper.cfg.memory_size = size;
+}
+
+static void
+hakomari_grow_payload_chunk(hakomari_device_t* device, size_t observed_size)
+{
+	size_t size = hakomari_adaptive_size(
+		device, device->payload_chunk_size, observed_size
+	);
+	if(size == device->payload_chunk_size) { return; }
+
+	uint8_t* payload_chunk = hakomari_device_realloc(
+		device, device->payload_chunk, size
+	);
+	if(payload_chunk == NULL) { return; }
+
+	device->payload_chunk = payload_chunk;
+	device->payload_chunk_size = size;
+}
+
+static void
+hakomari_grow_rx_buf(hakomari_device_t* device, size_t observed_size)
+{
+	size_t size = hakomari_adaptive_size(
+		device, device->rx_buf_size, observed_size
+	);
+	if(size == device->rx_buf_size) { return; }
+
+	uint8_t* rx_buf = hakomari_device_realloc(device, device->rx_buf, size);
+	if(rx_buf == NULL) { return; }
+
+	device->rx_buf = rx_buf;
+	device->rx_buf_size = size;
+}
+
+hakomari_error_t
+hakomari_open_device(
+	hakomari_ctx_t* ctx, size_t index, hakomari_device_t** device_ptr
+)
+{
+	return hakomari_open_device_ex(ctx, index, NULL, device_ptr);
+}
+
+static void
+hakomari_resolve_device_cfg(
+	const hakomari_device_cfg_t* cfg, hakomari_device_cfg_t* device_cfg
+)
+{
+	*device_cfg = cfg != NULL
+		? *cfg
+		: (hakomari_device_cfg_t){ .adaptive = false };
+	if(device_cfg->io_buf_size == 0) { device_cfg->io_buf_size = HAKOMARI_BUF_SIZE; }
+	if(device_cfg->payload_chunk_size == 0)
+	{
+		device_cfg->payload_chunk_size = HAKOMARI_BUF_SIZE;
+	}
+	if(device_cfg->rx_buf_size == 0) { device_cfg->rx_buf_size = HAKOMARI_RX_BUF_SIZE; }
+	if(device_cfg->max_buf_size == 0) { device_cfg->max_buf_size = HAKOMARI_MAX_BUF_SIZE; }
+	if(false
+		|| device_cfg->input_batch_size == 0
+		|| device_cfg->input_batch_size > HAKOMARI_INPUT_BATCH_SIZE
+	)
+	{
+		device_cfg->input_batch_size = HAKOMARI_INPUT_BATCH_SIZE;
+	}
+	if(device_cfg->batch_window == 0) { device_cfg->batch_window = HAKOMARI_BATCH_WINDOW; }
+	if(device_cfg->upload_window == 0) { device_cfg->upload_window = HAKOMARI_UPLOAD_WINDOW; }
+}
+
+static hakomari_error_t
+hakomari_open_port(hakomari_ctx_t* ctx, size_t index, struct sp_port** port_ptr)
+{
+	hakomari_device_desc_t* desc = &ctx->devices[index];
+
+	enum sp_return error;
 	struct sp_port* port;
 	hakomari_error_t hakomari_error;
 	if((error = sp_get_port_by_name(desc->sys_name, &port)) != SP_OK)
@@ -509,13 +2180,75 @@ hakomari_open_device(
 		return hakomari_error;
 	}
 
-	hakomari_device_t* device = malloc(sizeof(hakomari_device_t));
-	if(device == NULL)
+	*port_ptr = port;
+	return HAKOMARI_OK;
+}
+
+static void
+hakomari_free_device_buffers(hakomari_device_t* device)
+{
+	// Reverse allocation order lets an arena reclaim everything
+	hakomari_cache_cleanup(device);
+	hakomari_device_free(device, device->prepared_query_pool.memory);
+	hakomari_device_free(device, device->codec_buf);
+	hakomari_device_free(device, device->upload_buf);
+	hakomari_device_free(device, device->passphrase_screen.image_data);
+	hakomari_device_free(device, device->endpoint_handles);
+	hakomari_device_free(device, device->endpoints);
+	hakomari_mem_stream_cleanup(&device->payload_buff);
+	hakomari_device_free(device, device->rx_buf);
+	hakomari_device_free(device, device->payload_chunk);
+	hakomari_device_free(device, device->io_buf);
+}
+
+static hakomari_error_t
+hakomari_init_device(
+	hakomari_device_t* device, const hakomari_device_cfg_t* cfg
+)
+{
+	*device = (hakomari_device_t){
+		.ctx = device->ctx,
+		.allocator = device->allocator,
+		.arena = device->arena,
+		.static_storage = device->static_storage,
+		.port = device->port,
+		.result = { .userdata = device, .read = hakomari_device_read },
+		.adaptive = cfg->adaptive,
+		.lazy_drain = cfg->lazy_drain,
+		.input_coalesce_ms = cfg->input_coalesce_ms,
+		.input_batch_size = cfg->input_batch_size,
+		.batch_window = cfg->batch_window,
+		.upload_window = cfg->upload_window,
+		.max_buf_size = cfg->max_buf_size,
+		.io_buf_size = cfg->io_buf_size,
+		.payload_chunk_size = cfg->payload_chunk_size,
+		.rx_buf_size = cfg->rx_buf_size,
+		// Entries come and go, which an arena cannot reclaim
+		.cache = { .capacity = device->static_storage ? 0 : cfg->cache_size },
+	};
+	if(device->static_storage)
 	{
-		hakomari_error = hakomari_set_last_error(ctx, HAKOMARI_ERR_MEMORY, NULL);
-		sp_close(port);
-		sp_free_port(port);
-		return hakomari_error;
+		device->allocator.userdata = &device->arena;
+	}
+
+	hakomari_reset_cmp(device);
+	hakomari_mem_stream_init(&device->payload_buff, device, cfg->max_replay_size);
+	hakomari_mem_stream_init(
+		&device->cache.pending, device, device->cache.capacity
+	);
+
+	device->io_buf = hakomari_device_malloc(device, device->io_buf_size);
+	device->payload_chunk = hakomari_device_malloc(
+		device, device->payload_chunk_size
+	);
+	device->rx_buf = hakomari_device_malloc(device, device->rx_buf_size);
+	if(false
+		|| device->io_buf == NULL
+		|| device->payload_chunk == NULL
+		|| device->rx_buf == NULL
+	)
+	{
+		return HAKOMARI_ERR_MEMORY;
 	}
 
 	slipper_cfg_t slipper_cfg = {
@@ -524,19 +2257,162 @@ hakomari_open_device(
 			.read = hakomari_serial_read,
 			.write = hakomari_serial_write,
 		},
-		.memory_size = HAKOMARI_BUF_SIZE,
+		.memory_size = device->io_buf_size,
 		.memory = device->io_buf
 	};
-
-	*device = (hakomari_device_t){
-		.ctx = ctx,
-		.port = port,
-		.result = { .userdata = device, .read = hakomari_device_read }
-	};
-
-	hakomari_reset_cmp(device);
 	slipper_init(&device->slipper, &slipper_cfg);
-	hakomari_mem_stream_init(&device->payload_buff);
+
+	if(!device->static_storage) { return HAKOMARI_OK; }
+
+	// Everything a session can grow is set aside up front
+	if(!hakomari_mem_stream_reserve(&device->payload_buff, cfg->max_replay_size))
+	{
+		return HAKOMARI_ERR_MEMORY;
+	}
+
+	device->endpoints = hakomari_device_malloc(
+		device, HAKOMARI_STATIC_MAX_ENDPOINTS * sizeof(hakomari_endpoint_desc_t)
+	);
+	device->endpoint_handles = hakomari_device_malloc(
+		device, HAKOMARI_STATIC_MAX_ENDPOINTS * sizeof(uint32_t)
+	);
+	device->passphrase_screen.image_data = hakomari_device_malloc(
+		device, HAKOMARI_STATIC_SCREEN_SIZE
+	);
+
+	// Heap devices allocate these on first use: the upload window for their
+	// first chunked upload and the codec buffer once compression is negotiated
+	device->upload_buf = hakomari_device_malloc(device, device->upload_window);
+	device->codec_buf = HAKOMARI_STATIC_COMPRESSION
+		? hakomari_device_malloc(device, HAKOMARI_CODEC_SIZE)
+		: NULL;
+
+	// Prepared queries come and go in any order, which an arena cannot reclaim
+	hakomari_pool_init(
+		&device->prepared_query_pool,
+		hakomari_device_malloc(
+			device,
+			HAKOMARI_STATIC_MAX_PREPARED_QUERIES * HAKOMARI_PREPARED_QUERY_OVERHEAD
+		),
+		HAKOMARI_PREPARED_QUERY_OVERHEAD, HAKOMARI_STATIC_MAX_PREPARED_QUERIES
+	);
+	if(false
+		|| device->endpoints == NULL
+		|| device->endpoint_handles == NULL
+		|| device->passphrase_screen.image_data == NULL
+		|| device->upload_buf == NULL
+		|| (HAKOMARI_STATIC_COMPRESSION && device->codec_buf == NULL)
+		|| (true
+			&& HAKOMARI_STATIC_MAX_PREPARED_QUERIES > 0
+			&& device->prepared_query_pool.memory == NULL
+		)
+	)
+	{
+		return HAKOMARI_ERR_MEMORY;
+	}
+	device->endpoints_capacity = HAKOMARI_STATIC_MAX_ENDPOINTS;
+	device->passphrase_screen_capacity = HAKOMARI_STATIC_SCREEN_SIZE;
+
+	return HAKOMARI_OK;
+}
+
+hakomari_error_t
+hakomari_open_device_ex(
+	hakomari_ctx_t* ctx, size_t index, const hakomari_device_cfg_t* cfg,
+	hakomari_device_t** device_ptr
+)
+{
+	if(index > ctx->num_devices || device_ptr == NULL)
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	hakomari_device_cfg_t device_cfg;
+	hakomari_resolve_device_cfg(cfg, &device_cfg);
+
+	struct sp_port* port;
+	hakomari_error_t error;
+	if((error = hakomari_open_port(ctx, index, &port)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	hakomari_device_t* device = hakomari_malloc(ctx, sizeof(hakomari_device_t));
+	if(device == NULL)
+	{
+		sp_close(port);
+		sp_free_port(port);
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_MEMORY, NULL);
+	}
+
+	device->ctx = ctx;
+	device->allocator = ctx->allocator;
+	device->static_storage = false;
+	device->port = port;
+	if((error = hakomari_init_device(device, &device_cfg)) != HAKOMARI_OK)
+	{
+		hakomari_free_device_buffers(device);
+		hakomari_free(ctx, device);
+		sp_close(port);
+		sp_free_port(port);
+		return hakomari_set_last_error(ctx, error, NULL);
+	}
+
+	*device_ptr = device;
+	return hakomari_set_last_error(ctx, HAKOMARI_OK, NULL);
+}
+
+hakomari_error_t
+hakomari_open_device_static(
+	hakomari_ctx_t* ctx, size_t index, const hakomari_device_cfg_t* cfg,
+	void* storage, size_t storage_size, hakomari_device_t** device_ptr
+)
+{
+	if(index > ctx->num_devices || storage == NULL || device_ptr == NULL)
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	// Sizes are fixed so that HAKOMARI_DEVICE_STORAGE_SIZE always suffices
+	hakomari_device_cfg_t device_cfg;
+	hakomari_resolve_device_cfg(cfg, &device_cfg);
+	device_cfg.adaptive = false;
+	device_cfg.io_buf_size = HAKOMARI_STATIC_IO_BUF_SIZE;
+	device_cfg.payload_chunk_size = HAKOMARI_STATIC_PAYLOAD_CHUNK_SIZE;
+	device_cfg.rx_buf_size = HAKOMARI_STATIC_RX_BUF_SIZE;
+	device_cfg.max_replay_size = HAKOMARI_STATIC_REPLAY_SIZE;
+	device_cfg.upload_window = HAKOMARI_STATIC_UPLOAD_WINDOW;
+
+	struct hakomari_arena_s arena;
+	hakomari_arena_init(&arena, storage, storage_size);
+	hakomari_device_t* device = hakomari_arena_realloc(
+		&arena, NULL, sizeof(hakomari_device_t)
+	);
+	if(device == NULL)
+	{
+		return hakomari_set_last_error(ctx, HAKOMARI_ERR_MEMORY, NULL);
+	}
+
+	struct sp_port* port;
+	hakomari_error_t error;
+	if((error = hakomari_open_port(ctx, index, &port)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	device->ctx = ctx;
+	device->arena = arena;
+	device->allocator = (hakomari_allocator_t){
+		.realloc = hakomari_arena_realloc,
+	};
+	device->static_storage = true;
+	device->port = port;
+	if((error = hakomari_init_device(device, &device_cfg)) != HAKOMARI_OK)
+	{
+		sp_close(port);
+		sp_free_port(port);
+		return hakomari_set_last_error(ctx, error, NULL);
+	}
 
 	*device_ptr = device;
 	return hakomari_set_last_error(ctx, HAKOMARI_OK, NULL);
@@ -545,12 +2421,13 @@ hakomari_open_device(
 void
 hakomari_close_device(hakomari_device_t* device)
 {
-	if(device->passphrase_screen.image_data) { free(device->passphrase_screen.image_data); }
-	if(device->endpoints) { free(device->endpoints); }
+	hakomari_drain(device);
 	sp_close(device->port);
 	sp_free_port(device->port);
-	hakomari_mem_stream_cleanup(&device->payload_buff);
-	free(device);
+	hakomari_free_device_buffers(device);
+
+	// Static storage belongs to the caller
+	if(!device->static_storage) { hakomari_free(device->ctx, device); }
 }
 
 static hakomari_error_t
@@ -568,447 +2445,3547 @@ hakomari_set_cmp_error(hakomari_device_t* device)
 	}
 }
 
+static bool
+hakomari_read_field(
+	hakomari_device_t* device,
+	const char* const* field_names, uint32_t num_fields, uint32_t* field
+)
+{
+	if(device->caps & HAKOMARI_CAP_COMPACT_SCHEMA)
+	{
+		return cmp_read_uint(&device->cmp, field);
+	}
+
+	hakomari_string_t key;
+	uint32_t size = sizeof(key);
+	if(!cmp_read_str(&device->cmp, key, &size)) { return false; }
+
+	*field = num_fields;
+	for(uint32_t i = 0; i < num_fields; ++i)
+	{
+		if(strcmp(key, field_names[i]) == 0)
+		{
+			*field = i;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static bool
+hakomari_write_endpoint_desc(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc
+)
+{
+	// Digests are only reported by the device
+	if(device->caps & HAKOMARI_CAP_COMPACT_SCHEMA)
+	{
+		return true
+			&& cmp_write_array(&device->cmp, HAKOMARI_ENDPOINT_FIELD_DIGESTS)
+			&& cmp_write_str(&device->cmp, desc->type, strlen(desc->type))
+			&& cmp_write_str(&device->cmp, desc->name, strlen(desc->name));
+	}
+
+	return true
+		&& cmp_write_map(&device->cmp, HAKOMARI_ENDPOINT_FIELD_DIGESTS)
+		&& cmp_write_str(&device->cmp, "type", sizeof("type") - 1)
+		&& cmp_write_str(&device->cmp, desc->type, strlen(desc->type))
+		&& cmp_write_str(&device->cmp, "name", sizeof("name") - 1)
+		&& cmp_write_str(&device->cmp, desc->name, strlen(desc->name));
+}
+
+static bool
+hakomari_read_endpoint_digests(
+	hakomari_device_t* device, hakomari_endpoint_desc_t* desc
+)
+{
+	uint32_t num_digests;
+	if(!cmp_read_array(&device->cmp, &num_digests)) { return false; }
+
+	// Digests unknown to this library are skipped
+	size_t num_known = sizeof(HAKOMARI_DIGESTS) / sizeof(HAKOMARI_DIGESTS[0]);
+	for(uint32_t i = 0; i < num_digests; ++i)
+	{
+		hakomari_string_t name;
+		uint32_t size = sizeof(name);
+		if(!cmp_read_str(&device->cmp, name, &size)) { return false; }
+
+		for(size_t j = 0; j < num_known; ++j)
+		{
+			if(strcmp(name, HAKOMARI_DIGESTS[j].name) == 0)
+			{
+				desc->digests |= 1u << j;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool
+hakomari_read_cache_hints(
+	hakomari_device_t* device,
+	struct hakomari_cache_hint_s* hints, uint32_t* num_hints
+)
+{
+	// {query: ttl_ms}
+	uint32_t size;
+	if(!cmp_read_map(&device->cmp, &size)) { return false; }
+
+	*num_hints = 0;
+	for(uint32_t i = 0; i < size; ++i)
+	{
+		struct hakomari_cache_hint_s hint;
+		uint32_t query_size = sizeof(hint.query);
+		if(false
+			|| !cmp_read_str(&device->cmp, hint.query, &query_size)
+			|| !cmp_read_uint(&device->cmp, &hint.ttl_ms)
+		)
+		{
+			return false;
+		}
+
+		// Caching is optional: hints past the limit are ignored
+		if(*num_hints < HAKOMARI_MAX_CACHE_HINTS) { hints[(*num_hints)++] = hint; }
+	}
+
+	return true;
+}
+
 static hakomari_error_t
 hakomari_read_endpoint_desc(
 	hakomari_device_t* device, hakomari_endpoint_desc_t* desc
 )
 {
+	// Optional fields are only listed once their capability is negotiated
+	bool has_digests = (device->caps & HAKOMARI_CAP_DIGEST_SIGN) != 0;
+	bool has_hints = (device->caps & HAKOMARI_CAP_CACHE_HINTS) != 0;
+	uint32_t num_fields = HAKOMARI_ENDPOINT_FIELD_DIGESTS + has_digests + has_hints;
+	struct hakomari_cache_hint_s hints[HAKOMARI_MAX_CACHE_HINTS];
+	uint32_t num_hints = 0;
+	desc->digests = 0;
+
+	uint32_t size;
+	if(device->caps & HAKOMARI_CAP_COMPACT_SCHEMA)
+	{
+		// Positional: [type, name, (digests), (cacheable)]
+		if(!cmp_read_array(&device->cmp, &size))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		if(size != num_fields)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Format error"
+			);
+		}
+
+		uint32_t type_size = sizeof(desc->type);
+		uint32_t name_size = sizeof(desc->name);
+		if(false
+			|| !cmp_read_str(&device->cmp, desc->type, &type_size)
+			|| !cmp_read_str(&device->cmp, desc->name, &name_size)
+			|| (has_digests && !hakomari_read_endpoint_digests(device, desc))
+			|| (has_hints && !hakomari_read_cache_hints(device, hints, &num_hints))
+		)
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		hakomari_add_advertised_cache_rules(device, desc, hints, num_hints);
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
 	uint32_t map_size;
 	if(!cmp_read_map(&device->cmp, &map_size))
 	{
-		return hakomari_set_cmp_error(device);
+		return hakomari_set_cmp_error(device);
+	}
+
+	if(map_size != num_fields)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		);
+	}
+
+	memset(desc->type, 0, sizeof(desc->type));
+	memset(desc->name, 0, sizeof(desc->name));
+
+	for(uint32_t i = 0; i < map_size; ++i)
+	{
+		uint32_t field;
+		if(!hakomari_read_field(
+			device,
+			HAKOMARI_ENDPOINT_FIELD_NAMES, HAKOMARI_ENDPOINT_FIELD_COUNT, &field
+		))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		char* value;
+		switch(field)
+		{
+			case HAKOMARI_ENDPOINT_FIELD_TYPE:
+				value = desc->type;
+				break;
+			case HAKOMARI_ENDPOINT_FIELD_NAME:
+				value = desc->name;
+				break;
+			case HAKOMARI_ENDPOINT_FIELD_DIGESTS:
+				if(!hakomari_read_endpoint_digests(device, desc))
+				{
+					return hakomari_set_cmp_error(device);
+				}
+				continue;
+			case HAKOMARI_ENDPOINT_FIELD_CACHEABLE:
+				if(!hakomari_read_cache_hints(device, hints, &num_hints))
+				{
+					return hakomari_set_cmp_error(device);
+				}
+				continue;
+			default:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_IO, "Format error"
+				);
+		}
+
+		size = sizeof(hakomari_string_t);
+		if(!cmp_read_str(&device->cmp, value, &size))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+
+	// The name may follow the hints
+	hakomari_add_advertised_cache_rules(device, desc, hints, num_hints);
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+hakomari_error_t
+hakomari_inspect_endpoint(
+	hakomari_device_t* device,
+	size_t index, const hakomari_endpoint_desc_t** endpoint
+)
+{
+	if(index > device->num_endpoints || device == NULL)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	*endpoint = &device->endpoints[index];
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_begin_frame(hakomari_device_t* device, bool batched)
+{
+	hakomari_reset_cmp(device);
+	hakomari_grow_io_buf(device, device->frame_size);
+	hakomari_grow_rx_buf(device, device->frame_size);
+	device->frame_size = 0;
+	device->tx_size = 0;
+
+	// A new request ends the result being recorded for the cache
+	device->cache.recording = false;
+
+	// A batched frame follows the previous one in the same write
+	if((batched
+		? slipper_next_write(&device->slipper, HAKOMARI_DEVICE_TIMEOUT)
+		: slipper_begin_write(&device->slipper, HAKOMARI_DEVICE_TIMEOUT)
+	) != SLIPPER_OK)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Error writing message start"
+		);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static uint32_t*
+hakomari_find_endpoint_handle(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc
+)
+{
+	// Only descriptors from the enumerated table can be bound
+	if(false
+		|| desc == NULL
+		|| device->endpoint_handles == NULL
+		|| desc < device->endpoints
+		|| desc >= device->endpoints + device->num_endpoints
+	)
+	{
+		return NULL;
+	}
+
+	return &device->endpoint_handles[desc - device->endpoints];
+}
+
+static uint32_t
+hakomari_endpoint_handle(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc
+)
+{
+	uint32_t* handle = hakomari_find_endpoint_handle(device, desc);
+	return handle != NULL ? *handle : HAKOMARI_HANDLE_UNBOUND;
+}
+
+static void
+hakomari_invalidate_endpoints(hakomari_device_t* device)
+{
+	++device->endpoint_generation;
+	for(uint32_t i = 0; i < device->num_endpoints; ++i)
+	{
+		device->endpoint_handles[i] = HAKOMARI_HANDLE_UNBOUND;
+	}
+}
+
+static hakomari_error_t
+hakomari_write_request_header(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const hakomari_string_t query, uint32_t txid, uint8_t flags
+)
+{
+	// Flags are only sent when set so that plain requests stay unchanged
+	if(false
+		|| !cmp_write_array(&device->cmp, flags ? 5 : 4)
+		|| !cmp_write_u8(&device->cmp, HAKOMARI_FRAME_REQ)
+		|| !cmp_write_u32(&device->cmp, txid)
+		|| !cmp_write_str(&device->cmp, query, strlen(query))
+	)
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	uint32_t handle = hakomari_endpoint_handle(device, desc);
+	if(handle < HAKOMARI_HANDLE_FAILED)
+	{
+		// A bound endpoint is referred to by its handle
+		if(!cmp_write_uint(&device->cmp, handle))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+	else if(desc)
+	{
+		if(false
+			|| !cmp_write_array(&device->cmp, 2)
+			|| !cmp_write_str(&device->cmp, desc->type, strlen(desc->type))
+			|| !cmp_write_str(&device->cmp, desc->name, strlen(desc->name))
+		)
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+	else
+	{
+		if(!cmp_write_nil(&device->cmp))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+
+	if(flags && !cmp_write_u8(&device->cmp, flags))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_begin_query(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const hakomari_string_t query
+)
+{
+	hakomari_error_t error;
+	if((error = hakomari_begin_frame(device, false)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	return hakomari_write_request_header(
+		device, desc, query, device->txid++, 0
+	);
+}
+
+static hakomari_error_t
+hakomari_begin_prepared_query(
+	hakomari_device_t* device, const hakomari_prepared_query_t* prepared,
+	uint8_t flags
+)
+{
+	hakomari_error_t error;
+	if((error = hakomari_begin_frame(device, false)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	// Only the transaction id and the flags change between executions.
+	// Flags are appended as a fifth element, in which case the fixarray
+	// marker starting the header changes too.
+	uint32_t txid = device->txid++;
+	uint8_t array_marker = flags ? 0x95 : 0x94;
+	uint8_t txid_bytes[] = {
+		(uint8_t)(txid >> 24), (uint8_t)(txid >> 16),
+		(uint8_t)(txid >> 8), (uint8_t)txid,
+	};
+	uint8_t flags_bytes[] = { 0xcc, flags };
+	const uint8_t* prefix = prepared->header + 1;
+	const uint8_t* suffix = prepared->header + prepared->prefix_size;
+	slipper_error_t(*write_header)(
+		slipper_ctx_t* ctx, const void* data, size_t size,
+		slipper_timeout_t timeout
+	) = prepared->escaped ? slipper_write_raw : slipper_write;
+	if(false
+		|| slipper_write(
+			&device->slipper, &array_marker, sizeof(array_marker),
+			HAKOMARI_DEVICE_TIMEOUT
+		) != SLIPPER_OK
+		|| write_header(
+			&device->slipper, prefix, prepared->prefix_size - 1,
+			HAKOMARI_DEVICE_TIMEOUT
+		) != SLIPPER_OK
+		|| slipper_write(
+			&device->slipper, txid_bytes, sizeof(txid_bytes),
+			HAKOMARI_DEVICE_TIMEOUT
+		) != SLIPPER_OK
+		|| write_header(
+			&device->slipper, suffix, prepared->suffix_size,
+			HAKOMARI_DEVICE_TIMEOUT
+		) != SLIPPER_OK
+		|| (flags && slipper_write(
+			&device->slipper, flags_bytes, sizeof(flags_bytes),
+			HAKOMARI_DEVICE_TIMEOUT
+		) != SLIPPER_OK)
+	)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Error while sending request"
+		);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_buffer_reply(hakomari_device_t* device, bool* corrupted)
+{
+	*corrupted = false;
+	device->rx_size = 0;
+	device->rx_pos = 0;
+	device->rx_complete = false;
+	device->rx_has_flags = false;
+	device->rx_compressed = false;
+	device->rx_block_size = 0;
+	device->rx_block_pos = 0;
+
+	// Decode the reply once so that fields are parsed from memory
+	while(device->rx_size < device->rx_buf_size)
+	{
+		size_t requested_size = device->rx_buf_size - device->rx_size;
+		size_t size = requested_size;
+		slipper_error_t error = slipper_read(
+			&device->slipper, device->rx_buf + device->rx_size, &size,
+			HAKOMARI_DEVICE_TIMEOUT
+		);
+		if(error != SLIPPER_OK && device->ctx->last_error != HAKOMARI_OK)
+		{
+			return device->ctx->last_error;
+		}
+		else if(error != SLIPPER_OK)
+		{
+			*corrupted = false
+				|| error == SLIPPER_ERR_CHECKSUM
+				|| error == SLIPPER_ERR_ENCODING;
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, slipper_errorstr(error)
+			);
+		}
+
+		device->rx_size += size;
+		if(size < requested_size)
+		{
+			device->rx_complete = true;
+			break;
+		}
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+#if defined(HAKOMARI_CRC32_TABLE)
+static const uint32_t HAKOMARI_CRC32C_TABLE[256] = {
+	0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+	0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+	0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+	0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+	0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+	0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+	0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+	0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+	0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+	0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+	0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+	0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+	0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+	0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+	0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+	0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+	0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+	0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+	0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+	0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+	0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+	0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+	0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+	0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+	0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+	0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+	0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+	0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+	0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+	0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+	0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+	0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+	0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+	0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+	0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+	0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+	0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+	0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+	0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+	0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+	0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+	0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+	0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351,
+};
+#endif
+
+#if defined(HAKOMARI_CRC32_TABLE)
+static uint32_t
+hakomari_crc32c_table(uint32_t crc, const uint8_t* bytes, size_t size)
+{
+	for(; size > 0; --size)
+	{
+		crc = HAKOMARI_CRC32C_TABLE[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+#endif
+
+#if defined(HAKOMARI_CRC32_SSE42)
+#if defined(HAKOMARI_CRC32_DISPATCH)
+__attribute__((target("sse4.2")))
+#endif
+static uint32_t
+hakomari_crc32c_sse42(uint32_t crc, const uint8_t* bytes, size_t size)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	for(; size >= sizeof(uint64_t); size -= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, bytes, sizeof(word));
+		crc = (uint32_t)_mm_crc32_u64(crc, word);
+		bytes += sizeof(word);
+	}
+#else
+	for(; size >= sizeof(uint32_t); size -= sizeof(uint32_t))
+	{
+		uint32_t word;
+		memcpy(&word, bytes, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+		bytes += sizeof(word);
+	}
+#endif
+
+	for(; size > 0; --size) { crc = _mm_crc32_u8(crc, *bytes++); }
+
+	return crc;
+}
+#endif
+
+static uint32_t
+hakomari_crc32c(uint32_t crc, const void* data, size_t size)
+{
+	const uint8_t* bytes = data;
+	crc = ~crc;
+
+#if defined(HAKOMARI_CRC32_DISPATCH)
+	// The compiler runtime probes the CPU once at startup
+	crc = __builtin_cpu_supports("sse4.2")
+		? hakomari_crc32c_sse42(crc, bytes, size)
+		: hakomari_crc32c_table(crc, bytes, size);
+#elif defined(HAKOMARI_CRC32_SSE42)
+	crc = hakomari_crc32c_sse42(crc, bytes, size);
+#elif defined(HAKOMARI_CRC32_ARM)
+	for(; size >= sizeof(uint64_t); size -= sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, bytes, sizeof(word));
+		crc = __crc32cd(crc, word);
+		bytes += sizeof(word);
+	}
+
+	for(; size > 0; --size) { crc = __crc32cb(crc, *bytes++); }
+#else
+	crc = hakomari_crc32c_table(crc, bytes, size);
+#endif
+
+	return ~crc;
+}
+
+static hakomari_error_t
+hakomari_send_nak(hakomari_device_t* device, uint32_t txid)
+{
+	// [2, NAK, u32 txid]
+	uint8_t frame[] = {
+		0x92, HAKOMARI_FRAME_NAK, 0xce,
+		(uint8_t)(txid >> 24), (uint8_t)(txid >> 16),
+		(uint8_t)(txid >> 8), (uint8_t)txid,
+	};
+
+	// Written around slipper so the buffered replies are left intact
+	uint8_t encoded[SLIPPER_MAX_ENCODED_SIZE(sizeof(frame))];
+	size_t encoded_size = slipper_encode_message(
+		&device->slipper, encoded, frame, sizeof(frame)
+	);
+
+	if(device->slipper.cfg.serial.write(
+		device->slipper.cfg.serial.userdata,
+		encoded, encoded_size, true, HAKOMARI_DEVICE_TIMEOUT
+	) != SLIPPER_OK)
+	{
+		return device->ctx->last_error;
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_read_frame(
+	hakomari_device_t* device, uint32_t txid, bool resync, uint8_t* type
+)
+{
+	unsigned int num_naks = 0;
+
+	while(true)
+	{
+		// Stale frames are skipped without dropping what follows them
+		if((resync
+			? slipper_begin_read(&device->slipper, HAKOMARI_DEVICE_TIMEOUT)
+			: slipper_next_read(&device->slipper, HAKOMARI_DEVICE_TIMEOUT)
+		) != SLIPPER_OK)
+		{
+			return device->ctx->last_error;
+		}
+
+		resync = false;
+
+		bool corrupted;
+		if(hakomari_buffer_reply(device, &corrupted) != HAKOMARI_OK)
+		{
+			if(false
+				|| !corrupted
+				|| !(device->caps & HAKOMARI_CAP_FRAME_CHECKSUM)
+				|| num_naks >= HAKOMARI_NAK_ATTEMPTS
+			)
+			{
+				return device->ctx->last_error;
+			}
+
+			// The device resends every reply from this txid onward
+			++num_naks;
+			if(hakomari_send_nak(device, txid) != HAKOMARI_OK)
+			{
+				return device->ctx->last_error;
+			}
+
+			continue;
+		}
+
+		uint32_t size;
+		if(!cmp_read_array(&device->cmp, &size))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		if(size != 3 && size != 4)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Format error"
+			);
+		}
+
+		if(!cmp_read_u8(&device->cmp, type))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		// Only replies carry flags
+		device->rx_has_flags = size == 4;
+		if(false
+			|| (*type != HAKOMARI_FRAME_REP && *type != HAKOMARI_FRAME_ACK)
+			|| (*type != HAKOMARI_FRAME_REP && device->rx_has_flags)
+		)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Format error"
+			);
+		}
+
+		uint32_t frame_txid;
+		if(!cmp_read_u32(&device->cmp, &frame_txid))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		if(frame_txid == txid)
+		{
+			return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+		}
+
+		hakomari_reset_cmp(device);
+	}
+}
+
+static hakomari_error_t
+hakomari_device_status(uint8_t status)
+{
+	// Codes past HAKOMARI_ERR_IO are the library's own: a device sending one
+	// is not following the protocol
+	return status <= HAKOMARI_ERR_IO ? (hakomari_error_t)status : HAKOMARI_ERR_IO;
+}
+
+static hakomari_error_t
+hakomari_read_status(
+	hakomari_device_t* device,
+	hakomari_error_t* status, hakomari_input_t** result
+)
+{
+	uint8_t reply_status;
+	if(!cmp_read_u8(&device->cmp, &reply_status))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	uint8_t flags = 0;
+	if(device->rx_has_flags && !cmp_read_u8(&device->cmp, &flags))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	// The body after the header may be compressed
+	device->rx_compressed = (flags & HAKOMARI_REPLY_COMPRESSED) != 0;
+	if(device->rx_compressed && device->codec_buf == NULL)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		);
+	}
+
+	*status = hakomari_device_status(reply_status);
+	if(result)
+	{
+		*result = *status == HAKOMARI_OK ? &device->result : NULL;
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_read_reply(
+	hakomari_device_t* device, uint32_t txid, bool resync,
+	hakomari_error_t* status, hakomari_input_t** result
+)
+{
+	uint8_t type;
+	if(hakomari_read_frame(device, txid, resync, &type) != HAKOMARI_OK)
+	{
+		return device->ctx->last_error;
+	}
+
+	if(type != HAKOMARI_FRAME_REP)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		);
+	}
+
+	return hakomari_read_status(device, status, result);
+}
+
+static hakomari_error_t
+hakomari_end_query_status(
+	hakomari_device_t* device,
+	hakomari_error_t* status, hakomari_input_t** result
+)
+{
+	slipper_error_t error;
+	if(false
+		|| (error = hakomari_flush_request(device)) != SLIPPER_OK
+		|| (error = slipper_end_write(&device->slipper, HAKOMARI_DEVICE_TIMEOUT)) != 0
+	)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, slipper_errorstr(error)
+		);
+	}
+
+	// Barrier: everything queued must reach the device before its reply
+	if(hakomari_drain(device) != HAKOMARI_OK) { return device->ctx->last_error; }
+
+	return hakomari_read_reply(device, device->txid - 1, true, status, result);
+}
+
+static hakomari_error_t
+hakomari_end_query(hakomari_device_t* device, hakomari_input_t** result)
+{
+	hakomari_error_t status;
+	if(hakomari_end_query_status(device, &status, result) != HAKOMARI_OK)
+	{
+		return device->ctx->last_error;
+	}
+
+	return hakomari_set_last_error(device->ctx, status, NULL);
+}
+
+static hakomari_error_t
+hakomari_negotiate(hakomari_device_t* device)
+{
+	if(device->caps_negotiated)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	device->caps = 0;
+
+	// Compressed replies can arrive as soon as compression is enabled so its
+	// buffers must exist beforehand
+	if(device->codec_buf == NULL && !device->static_storage)
+	{
+		device->codec_buf = hakomari_device_malloc(device, HAKOMARI_CODEC_SIZE);
+	}
+
+	// Offer every capability this library supports, the device replies with
+	// the ones it enables. COBS needs room for a whole block in the buffer.
+	size_t num_caps = sizeof(HAKOMARI_CAP_NAMES) / sizeof(HAKOMARI_CAP_NAMES[0]);
+	uint32_t offered = 0;
+	uint32_t num_offered = 0;
+	for(size_t i = 0; i < num_caps; ++i)
+	{
+		if(false
+			|| (true
+				&& HAKOMARI_CAP_NAMES[i].cap == HAKOMARI_CAP_COBS_FRAMING
+				&& device->io_buf_size < SLIPPER_COBS_MIN_MEMORY
+			)
+			|| (true
+				&& HAKOMARI_CAP_NAMES[i].cap == HAKOMARI_CAP_COMPRESSION
+				&& device->codec_buf == NULL
+			)
+			|| (true
+				&& HAKOMARI_CAP_NAMES[i].cap == HAKOMARI_CAP_CACHE_HINTS
+				&& device->cache.capacity == 0
+			)
+		)
+		{
+			continue;
+		}
+
+		offered |= HAKOMARI_CAP_NAMES[i].cap;
+		++num_offered;
+	}
+
+	hakomari_error_t error;
+	if((error = hakomari_begin_query(device, NULL, "@capabilities")) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	if(!cmp_write_array(&device->cmp, num_offered))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	for(size_t i = 0; i < num_caps; ++i)
+	{
+		const char* name = HAKOMARI_CAP_NAMES[i].name;
+		if(true
+			&& (offered & HAKOMARI_CAP_NAMES[i].cap)
+			&& !cmp_write_str(&device->cmp, name, (uint32_t)strlen(name))
+		)
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+
+	// Without a reply, the negotiation is attempted again on the next query.
+	// The device may already use the new framing so only a status which
+	// rejects the query selects the base protocol.
+	hakomari_error_t status;
+	if(hakomari_end_query_status(device, &status, NULL) != HAKOMARI_OK)
+	{
+		return device->ctx->last_error;
+	}
+
+	if(status != HAKOMARI_OK)
+	{
+		// Older firmware does not know this query: use the base protocol
+		device->caps_negotiated = true;
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	uint32_t num_enabled;
+	if(!cmp_read_array(&device->cmp, &num_enabled))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	uint32_t caps = 0;
+	for(uint32_t i = 0; i < num_enabled; ++i)
+	{
+		hakomari_string_t name;
+		uint32_t size = sizeof(name);
+		if(!cmp_read_str(&device->cmp, name, &size))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		for(size_t j = 0; j < num_caps; ++j)
+		{
+			if(strcmp(name, HAKOMARI_CAP_NAMES[j].name) == 0)
+			{
+				caps |= HAKOMARI_CAP_NAMES[j].cap;
+			}
+		}
+	}
+
+	device->caps = caps & offered;
+	device->caps_negotiated = true;
+
+	if(!(device->caps & HAKOMARI_CAP_COMPRESSION) && !device->static_storage)
+	{
+		hakomari_device_free(device, device->codec_buf);
+		device->codec_buf = NULL;
+	}
+
+	if(!(device->caps & (HAKOMARI_CAP_FRAME_CHECKSUM | HAKOMARI_CAP_COBS_FRAMING)))
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	// Every frame after the negotiation carries a checksum
+	if(device->caps & HAKOMARI_CAP_FRAME_CHECKSUM)
+	{
+		device->slipper.cfg.checksum = hakomari_crc32c;
+	}
+
+	if(device->caps & HAKOMARI_CAP_COBS_FRAMING)
+	{
+		device->slipper.cfg.framing = SLIPPER_FRAMING_COBS;
+	}
+
+	// The device accepts both framings and only switches once a frame in the
+	// new one reaches it: a lost @capabilities reply leaves both sides on the
+	// old framing. @commit-framing is that frame. Should it be lost too, the
+	// device still accepts the next query in the new framing.
+	if(false
+		|| hakomari_begin_query(device, NULL, "@commit-framing") != HAKOMARI_OK
+		|| hakomari_end_query_status(device, &status, NULL) != HAKOMARI_OK
+	)
+	{
+		return device->ctx->last_error;
+	}
+
+	// Firmware which switched right after its reply rejects the query
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static void
+hakomari_encode_block(hakomari_device_t* device, size_t size)
+{
+	struct hakomari_compressor_s* compressor = &device->compressor;
+	const uint8_t* raw = hakomari_codec_raw_block(device);
+	uint8_t* encoded = hakomari_codec_encoded_block(device);
+	uint8_t* body = encoded + HAKOMARI_BLOCK_HEADER_SIZE;
+
+	// Only blocks which get smaller are sent compressed
+	size_t compressed_size = compressor->incompressible
+		? 0
+		: hakomari_lz_compress(
+			raw, size, body, size - 1, (uint16_t*)device->codec_buf
+		);
+
+	// The first block is a sample: when it barely compresses, the rest of
+	// the stream is sent as is without trying
+	if(!compressor->sampled)
+	{
+		compressor->sampled = true;
+		compressor->incompressible = false
+			|| compressed_size == 0
+			|| compressed_size > size - size / 8;
+	}
+
+	uint16_t block_header;
+	if(compressed_size > 0)
+	{
+		block_header = (uint16_t)compressed_size;
+	}
+	else
+	{
+		memcpy(body, raw, size);
+		block_header = (uint16_t)(size | HAKOMARI_BLOCK_STORED);
+	}
+
+	encoded[0] = (uint8_t)(block_header >> 8);
+	encoded[1] = (uint8_t)block_header;
+	compressor->encoded_pos = 0;
+	compressor->encoded_size = HAKOMARI_BLOCK_HEADER_SIZE
+		+ (compressed_size > 0 ? compressed_size : size);
+}
+
+static hakomari_error_t
+hakomari_fill_block(hakomari_device_t* device)
+{
+	struct hakomari_compressor_s* compressor = &device->compressor;
+	uint8_t* raw = hakomari_codec_raw_block(device);
+	size_t size = 0;
+	while(!compressor->drained && size < HAKOMARI_COMPRESSION_BLOCK_SIZE)
+	{
+		size_t chunk_size = HAKOMARI_COMPRESSION_BLOCK_SIZE - size;
+		hakomari_error_t error;
+		if((error = hakomari_read(
+			compressor->source, raw + size, &chunk_size
+		)) != HAKOMARI_OK)
+		{
+			return error;
+		}
+
+		// The raw bytes are recorded so that a replay compresses them again
+		if(true
+			&& compressor->record
+			&& !hakomari_mem_stream_write(&device->payload_buff, raw + size, chunk_size)
+		)
+		{
+			return HAKOMARI_ERR_MEMORY;
+		}
+
+		compressor->drained = chunk_size == 0;
+		size += chunk_size;
+	}
+
+	if(size > 0) { hakomari_encode_block(device, size); }
+
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_compressor_read(void* userdata, void* buf, size_t* size)
+{
+	hakomari_device_t* device = userdata;
+	struct hakomari_compressor_s* compressor = &device->compressor;
+
+	if(compressor->encoded_pos == compressor->encoded_size && !compressor->drained)
+	{
+		hakomari_error_t error;
+		if((error = hakomari_fill_block(device)) != HAKOMARI_OK) { return error; }
+	}
+
+	size_t num_available = compressor->encoded_size - compressor->encoded_pos;
+	if(*size > num_available) { *size = num_available; }
+
+	memcpy(
+		buf,
+		hakomari_codec_encoded_block(device) + compressor->encoded_pos,
+		*size
+	);
+	compressor->encoded_pos += *size;
+	return HAKOMARI_OK;
+}
+
+static bool
+hakomari_use_compression(hakomari_device_t* device, hakomari_input_t* payload)
+{
+	if(false
+		|| payload == NULL
+		|| device->codec_buf == NULL
+		|| !(device->caps & HAKOMARI_CAP_COMPRESSION)
+	)
+	{
+		return false;
+	}
+
+	// Tiny payloads do not make up for the block header
+	uint64_t payload_size;
+	return false
+		|| payload->size == NULL
+		|| payload->size(payload->userdata, &payload_size) != HAKOMARI_OK
+		|| payload_size >= HAKOMARI_COMPRESSION_MIN_SIZE;
+}
+
+static hakomari_input_t*
+hakomari_begin_compression(
+	hakomari_device_t* device, hakomari_input_t* source, bool record
+)
+{
+	if(record) { hakomari_mem_stream_reset(&device->payload_buff); }
+
+	device->compressor = (struct hakomari_compressor_s){
+		.input = { .userdata = device, .read = hakomari_compressor_read },
+		.source = source,
+		.record = record,
+	};
+	return &device->compressor.input;
+}
+
+static hakomari_error_t
+hakomari_send_borrowed_payload(
+	hakomari_device_t* device, hakomari_input_t* source, bool record
+)
+{
+	while(true)
+	{
+		const void* data;
+		size_t size;
+		if(source->peek(source->userdata, &data, &size) != HAKOMARI_OK)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Error while reading payload"
+			);
+		}
+
+		if(size == 0) { break; }
+
+		if(record && !hakomari_mem_stream_write(&device->payload_buff, data, size))
+		{
+			return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_MEMORY, NULL);
+		}
+
+		// Escape straight from the caller's memory
+		if(slipper_write(
+			&device->slipper, data, size, HAKOMARI_DEVICE_TIMEOUT
+		) != SLIPPER_OK)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Error while sending payload"
+			);
+		}
+
+		if(source->consume(source->userdata, size) != HAKOMARI_OK)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_INVALID, "Invalid payload stream"
+			);
+		}
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_send_payload(
+	hakomari_device_t* device, hakomari_input_t* source, bool record
+)
+{
+	size_t size;
+
+	if(record) { hakomari_mem_stream_reset(&device->payload_buff); }
+
+	// The request header precedes the payload in the frame
+	if(hakomari_flush_request(device) != SLIPPER_OK)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Error while sending request"
+		);
+	}
+
+	if(source->peek != NULL && source->consume != NULL)
+	{
+		return hakomari_send_borrowed_payload(device, source, record);
+	}
+
+	do
+	{
+		uint8_t* buf = device->payload_chunk;
+		size_t chunk_size = device->payload_chunk_size;
+		size = chunk_size;
+		switch(hakomari_read(source, buf, &size))
+		{
+			case HAKOMARI_OK:
+				if(record &&
+					!hakomari_mem_stream_write(&device->payload_buff, buf, size)
+				)
+				{
+					return hakomari_set_last_error(
+						device->ctx, HAKOMARI_ERR_MEMORY, NULL
+					);
+				}
+
+				if(slipper_write(
+					&device->slipper, buf, size, HAKOMARI_DEVICE_TIMEOUT
+				) != SLIPPER_OK)
+				{
+					return hakomari_set_last_error(
+						device->ctx, HAKOMARI_ERR_IO, "Error while sending payload"
+					);
+				}
+
+				// A full chunk hints at a large payload
+				if(size == chunk_size)
+				{
+					hakomari_grow_payload_chunk(device, chunk_size * 2);
+					hakomari_grow_io_buf(device, device->payload_chunk_size);
+				}
+				break;
+			case HAKOMARI_ERR_IO:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_IO, "Error while reading payload"
+				);
+			case HAKOMARI_ERR_MEMORY:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_MEMORY, NULL
+				);
+			default:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_INVALID, "Invalid payload stream"
+				);
+		}
+	} while(size);
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static void
+hakomari_size_payload_buffers(
+	hakomari_device_t* device, hakomari_input_t* payload, bool record
+)
+{
+	uint64_t payload_size;
+	if(false
+		|| payload->size == NULL
+		|| payload->size(payload->userdata, &payload_size) != HAKOMARI_OK
+	)
+	{
+		return;
+	}
+
+	size_t size = payload_size < SIZE_MAX ? (size_t)payload_size : SIZE_MAX;
+	hakomari_grow_payload_chunk(device, size);
+	hakomari_grow_io_buf(device, device->payload_chunk_size);
+
+	// Best-effort: the replay buffer still grows on demand
+	if(record) { hakomari_mem_stream_reserve(&device->payload_buff, size); }
+}
+
+static bool
+hakomari_use_chunked_upload(
+	hakomari_device_t* device, hakomari_input_t* payload, bool record
+)
+{
+	// A payload being recorded for a replay keeps the single frame
+	if(false
+		|| payload == NULL
+		|| record
+		|| !(device->caps & HAKOMARI_CAP_CHUNKED_UPLOAD)
+	)
+	{
+		return false;
+	}
+
+	// So does one known to fit in a single chunk
+	uint64_t payload_size;
+	if(true
+		&& payload->size != NULL
+		&& payload->size(payload->userdata, &payload_size) == HAKOMARI_OK
+		&& payload_size <= device->payload_chunk_size
+	)
+	{
+		return false;
+	}
+
+	// Static storage reserved the window when the device was opened, without
+	// it the payload is sent as a whole
+	if(device->upload_buf == NULL && !device->static_storage)
+	{
+		device->upload_buf = hakomari_device_malloc(device, device->upload_window);
+	}
+
+	return device->upload_buf != NULL;
+}
+
+static hakomari_error_t
+hakomari_send_chunk(
+	hakomari_device_t* device, uint32_t txid, uint64_t offset,
+	const uint8_t* data, size_t size, bool ack, bool batched
+)
+{
+	hakomari_error_t error;
+	if((error = hakomari_begin_frame(device, batched)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	if(false
+		|| !cmp_write_array(&device->cmp, 5)
+		|| !cmp_write_u8(&device->cmp, HAKOMARI_FRAME_CHUNK)
+		|| !cmp_write_u32(&device->cmp, txid)
+		|| !cmp_write_uint(&device->cmp, offset)
+		|| !cmp_write_u32(&device->cmp, hakomari_crc32c(0, data, size))
+		|| !cmp_write_bool(&device->cmp, ack)
+	)
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	if(false
+		|| hakomari_flush_request(device) != SLIPPER_OK
+		|| slipper_write(
+			&device->slipper, data, size, HAKOMARI_DEVICE_TIMEOUT
+		) != SLIPPER_OK
+	)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Error while sending payload"
+		);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_send_upload_window(
+	hakomari_device_t* device, uint32_t txid,
+	uint64_t offset, size_t size, bool end, bool batched
+)
+{
+	// Only the last chunk asks for an acknowledgement. An empty chunk marks
+	// the end of the payload and is answered with the reply.
+	size_t chunk_size = device->payload_chunk_size < device->upload_window
+		? device->payload_chunk_size
+		: device->upload_window;
+	const uint8_t* data = device->upload_buf;
+	hakomari_error_t error;
+	while(size > 0)
+	{
+		size_t send_size = size < chunk_size ? size : chunk_size;
+		bool last = send_size == size;
+		if((error = hakomari_send_chunk(
+			device, txid, offset, data, send_size, last && !end, batched
+		)) != HAKOMARI_OK)
+		{
+			return error;
+		}
+
+		batched = true;
+		offset += send_size;
+		data += send_size;
+		size -= send_size;
+	}
+
+	if(end && (error = hakomari_send_chunk(
+		device, txid, offset, NULL, 0, true, batched
+	)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	if(slipper_end_write(&device->slipper, HAKOMARI_DEVICE_TIMEOUT) != SLIPPER_OK)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Error while sending payload"
+		);
+	}
+
+	return hakomari_drain(device);
+}
+
+static hakomari_error_t
+hakomari_upload_payload(
+	hakomari_device_t* device, hakomari_input_t* source,
+	hakomari_input_t** result
+)
+{
+	uint32_t txid = device->txid - 1;
+	uint64_t acked = 0;
+	size_t retained = 0;
+	bool end = false;
+	unsigned int attempts = 0;
+
+	// The first chunks follow the request header in the same write
+	bool batched = true;
+	if(hakomari_flush_request(device) != SLIPPER_OK)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Error while sending request"
+		);
+	}
+
+	while(true)
+	{
+		// Bytes are retained until the device acknowledges them
+		while(!end && retained < device->upload_window)
+		{
+			size_t size = device->upload_window - retained;
+			switch(hakomari_read(source, device->upload_buf + retained, &size))
+			{
+				case HAKOMARI_OK:
+					break;
+				case HAKOMARI_ERR_IO:
+					return hakomari_set_last_error(
+						device->ctx, HAKOMARI_ERR_IO, "Error while reading payload"
+					);
+				default:
+					return hakomari_set_last_error(
+						device->ctx, HAKOMARI_ERR_INVALID, "Invalid payload stream"
+					);
+			}
+
+			end = size == 0;
+			retained += size;
+		}
+
+		// Everything not acknowledged yet is (re)sent
+		uint8_t type = HAKOMARI_FRAME_ACK;
+		uint64_t offset;
+		hakomari_error_t error = hakomari_send_upload_window(
+			device, txid, acked, retained, end, batched
+		);
+		batched = false;
+
+		// Late acknowledgements from a previous attempt are skipped
+		bool resync = true;
+		while(true
+			&& error == HAKOMARI_OK
+			&& (error = hakomari_read_frame(
+				device, txid, resync, &type
+			)) == HAKOMARI_OK
+			&& type == HAKOMARI_FRAME_ACK
+		)
+		{
+			resync = false;
+			if(!cmp_read_uinteger(&device->cmp, &offset))
+			{
+				error = hakomari_set_cmp_error(device);
+			}
+			else if(offset > acked + retained)
+			{
+				error = hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_IO, "Format error"
+				);
+			}
+			else if(offset >= acked)
+			{
+				break;
+			}
+		}
+
+		if(error == HAKOMARI_OK && type == HAKOMARI_FRAME_REP)
+		{
+			hakomari_error_t status;
+			if(hakomari_read_status(device, &status, result) != HAKOMARI_OK)
+			{
+				return device->ctx->last_error;
+			}
+
+			return hakomari_set_last_error(device->ctx, status, NULL);
+		}
+
+		// Resume from the last acknowledged offset
+		size_t acked_size = 0;
+		if(error == HAKOMARI_OK)
+		{
+			acked_size = (size_t)(offset - acked);
+			memmove(
+				device->upload_buf, device->upload_buf + acked_size,
+				retained - acked_size
+			);
+			retained -= acked_size;
+			acked = offset;
+		}
+
+		attempts = acked_size > 0 ? 0 : attempts + 1;
+		if(attempts >= HAKOMARI_UPLOAD_ATTEMPTS)
+		{
+			return error != HAKOMARI_OK
+				? error
+				: hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_IO, "Upload is not progressing"
+				);
+		}
+	}
+}
+
+static hakomari_error_t
+hakomari_query_endpoint_once(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	const char* query, const hakomari_prepared_query_t* prepared,
+	hakomari_input_t* payload, uint8_t flags, bool record,
+	hakomari_input_t** result
+)
+{
+	hakomari_input_t* source = payload;
+	if(hakomari_use_compression(device, payload))
+	{
+		flags |= HAKOMARI_REQUEST_COMPRESSED;
+		source = hakomari_begin_compression(device, payload, record);
+	}
+
+	if(hakomari_use_chunked_upload(device, payload, record))
+	{
+		hakomari_error_t error;
+		if(false
+			|| (error = hakomari_begin_frame(device, false)) != HAKOMARI_OK
+			|| (error = hakomari_write_request_header(
+				device, desc, prepared != NULL ? prepared->query : query,
+				device->txid++, flags | HAKOMARI_REQUEST_CHUNKED
+			)) != HAKOMARI_OK
+		)
+		{
+			return error;
+		}
+
+		return hakomari_upload_payload(device, source, result);
+	}
+
+	// A handle in a prepared header is only valid for its generation
+	hakomari_error_t error;
+	if(true
+		&& prepared != NULL
+		&& prepared->endpoint_generation == device->endpoint_generation
+	)
+	{
+		error = hakomari_begin_prepared_query(device, prepared, flags);
+	}
+	else if((error = hakomari_begin_frame(device, false)) == HAKOMARI_OK)
+	{
+		error = hakomari_write_request_header(
+			device, desc, prepared != NULL ? prepared->query : query,
+			device->txid++, flags
+		);
+	}
+	if(error != HAKOMARI_OK) { return error; }
+
+	// The compressor records the raw payload itself
+	if(true
+		&& source != NULL
+		&& (error = hakomari_send_payload(
+			device, source, record && source == payload
+		)) != HAKOMARI_OK
+	)
+	{
+		return error;
+	}
+
+	return hakomari_end_query(device, result);
+}
+
+static hakomari_error_t
+hakomari_query_endpoint_authenticated(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
+	bool first_time,
+	const char* query, const hakomari_prepared_query_t* prepared,
+	hakomari_input_t* payload, uint8_t flags, hakomari_input_t** result
+)
+{
+	hakomari_input_t* source = payload;
+	bool record = false;
+	if(payload != NULL && payload->rewind != NULL)
+	{
+		// A rewindable payload is replayed from its source
+		if(!first_time && payload->rewind(payload->userdata) != HAKOMARI_OK)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Error while rewinding payload"
+			);
+		}
+	}
+	else if(payload != NULL)
+	{
+		// Otherwise, record it the first time so it can be replayed after
+		// authentication
+		if(!first_time && device->payload_buff.overflowed)
+		{
+			// The device is authenticated now, only the caller can resend
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_RETRY,
+				"Payload is too large to replay, query again"
+			);
+		}
+		else if(!first_time)
+		{
+			source = hakomari_mem_stream_as_input(&device->payload_buff);
+		}
+
+		record = first_time;
+	}
+
+	if(first_time && payload != NULL)
+	{
+		hakomari_size_payload_buffers(device, payload, record);
+	}
+
+	return hakomari_query_endpoint_once(
+		device, desc, query, prepared, source, flags, record, result
+	);
+}
+
+static uint64_t
+hakomari_hash(const void* data, size_t size)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(size_t i = 0; i < size; ++i)
+	{
+		hash ^= ((const uint8_t*)data)[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void
+hakomari_rect_union(hakomari_rect_t* dst, const hakomari_rect_t* rect)
+{
+	if(rect->width == 0 || rect->height == 0) { return; }
+	if(dst->width == 0 || dst->height == 0) { *dst = *rect; return; }
+
+	unsigned int right = dst->x + dst->width;
+	unsigned int bottom = dst->y + dst->height;
+	if(rect->x + rect->width > right) { right = rect->x + rect->width; }
+	if(rect->y + rect->height > bottom) { bottom = rect->y + rect->height; }
+	if(rect->x < dst->x) { dst->x = rect->x; }
+	if(rect->y < dst->y) { dst->y = rect->y; }
+	dst->width = right - dst->x;
+	dst->height = bottom - dst->y;
+}
+
+static hakomari_error_t
+hakomari_read_screen_deltas(hakomari_device_t* device)
+{
+	hakomari_passphrase_screen_t* screen = &device->passphrase_screen;
+	if(!device->passphrase_screen_cached)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		);
+	}
+
+	uint32_t num_deltas;
+	if(!cmp_read_array(&device->cmp, &num_deltas))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	uint8_t* image_data = screen->image_data;
+	for(uint32_t i = 0; i < num_deltas; ++i)
+	{
+		uint32_t size;
+		hakomari_rect_t rect;
+		if(false
+			|| !cmp_read_array(&device->cmp, &size)
+			|| size != 5
+			|| !cmp_read_uint(&device->cmp, &rect.x)
+			|| !cmp_read_uint(&device->cmp, &rect.y)
+			|| !cmp_read_uint(&device->cmp, &rect.width)
+			|| !cmp_read_uint(&device->cmp, &rect.height)
+			|| !cmp_read_bin_size(&device->cmp, &size)
+		)
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		if(false
+			|| rect.x > screen->width || rect.width > screen->width - rect.x
+			|| rect.y > screen->height || rect.height > screen->height - rect.y
+			|| size != ((size_t)rect.width * rect.height + 7) / 8
+		)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Format error"
+			);
+		}
+
+		// Rectangle bits are packed the same way as the whole screen
+		size_t bit = 0;
+		uint8_t byte = 0;
+		for(unsigned int y = rect.y; y < rect.y + rect.height; ++y)
+		{
+			for(unsigned int x = rect.x; x < rect.x + rect.width; ++x, ++bit)
+			{
+				if(bit % 8 == 0 && !device->cmp.read(&device->cmp, &byte, 1))
+				{
+					return hakomari_set_cmp_error(device);
+				}
+
+				size_t index = x + (size_t)y * screen->width;
+				uint8_t mask = (uint8_t)(1 << (index % 8));
+				if((byte >> (bit % 8)) & 1)
+				{
+					image_data[index / 8] |= mask;
+				}
+				else
+				{
+					image_data[index / 8] &= (uint8_t)~mask;
+				}
+			}
+		}
+
+		hakomari_rect_union(&screen->dirty, &rect);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_read_screen_image(hakomari_device_t* device)
+{
+	hakomari_passphrase_screen_t* passphrase_screen = &device->passphrase_screen;
+	uint32_t image_data_size;
+	if(!cmp_read_bin_size(&device->cmp, &image_data_size))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	// The cached screen is about to be overwritten
+	device->passphrase_screen_cached = false;
+	if(image_data_size > device->passphrase_screen_capacity)
+	{
+		void* image_data = device->static_storage
+			? NULL
+			: hakomari_device_realloc(
+				device, passphrase_screen->image_data, image_data_size
+			);
+		if(image_data == NULL)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_MEMORY, "Screen is too large"
+			);
+		}
+
+		passphrase_screen->image_data = image_data;
+		device->passphrase_screen_capacity = image_data_size;
+	}
+	device->passphrase_screen_size = image_data_size;
+
+	if(!device->cmp.read(
+		&device->cmp, passphrase_screen->image_data, image_data_size
+	))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	return HAKOMARI_OK;
+}
+
+static hakomari_error_t
+hakomari_fetch_passphrase_screen(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint
+)
+{
+	hakomari_error_t error;
+	bool delta = (device->caps & HAKOMARI_CAP_SCREEN_DELTA) != 0;
+
+	// Get specification for the passphrase input screen.
+	// With screen deltas, send the hash of the cached screen so that the
+	// device only sends what changed.
+	if((error = hakomari_begin_query(
+		device, endpoint, "@get-passphrase-screen"
+	)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	if(delta)
+	{
+		if(!(device->passphrase_screen_cached
+			? cmp_write_uint(&device->cmp, device->passphrase_screen_hash)
+			: cmp_write_nil(&device->cmp)
+		))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+
+	if((error = hakomari_end_query(device, NULL)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	uint32_t map_size;
+	if(!cmp_read_map(&device->cmp, &map_size))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	if(delta ? (map_size < 3 || map_size > 4) : map_size != 3)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		);
+	}
+
+	hakomari_passphrase_screen_t* passphrase_screen = &device->passphrase_screen;
+	uint32_t width = passphrase_screen->width;
+	uint32_t height = passphrase_screen->height;
+	bool has_hash = false;
+	bool has_image = false;
+	uint64_t hash = 0;
+	passphrase_screen->dirty = (hakomari_rect_t){ 0 };
+
+	for(uint32_t i = 0; i < map_size; ++i)
+	{
+		uint32_t field;
+		if(!hakomari_read_field(
+			device,
+			HAKOMARI_SCREEN_FIELD_NAMES, HAKOMARI_SCREEN_FIELD_COUNT, &field
+		))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		// Only deltas-enabled replies carry the hash and deltas
+		if(!delta
+			&& (field == HAKOMARI_SCREEN_FIELD_HASH
+				|| field == HAKOMARI_SCREEN_FIELD_DELTAS)
+		)
+		{
+			field = HAKOMARI_SCREEN_FIELD_COUNT;
+		}
+
+		switch(field)
+		{
+			case HAKOMARI_SCREEN_FIELD_WIDTH:
+				if(!cmp_read_uint(&device->cmp, &width))
+				{
+					return hakomari_set_cmp_error(device);
+				}
+				break;
+			case HAKOMARI_SCREEN_FIELD_HEIGHT:
+				if(!cmp_read_uint(&device->cmp, &height))
+				{
+					return hakomari_set_cmp_error(device);
+				}
+				break;
+			case HAKOMARI_SCREEN_FIELD_HASH:
+				if(!cmp_read_ulong(&device->cmp, &hash))
+				{
+					return hakomari_set_cmp_error(device);
+				}
+
+				has_hash = true;
+				break;
+			case HAKOMARI_SCREEN_FIELD_IMAGE_DATA:
+				if((error = hakomari_read_screen_image(device)) != HAKOMARI_OK)
+				{
+					return error;
+				}
+
+				has_image = true;
+				break;
+			case HAKOMARI_SCREEN_FIELD_DELTAS:
+				// Deltas are relative to the cached screen whose hash was sent
+				if((error = hakomari_read_screen_deltas(device)) != HAKOMARI_OK)
+				{
+					device->passphrase_screen_cached = false;
+					return error;
+				}
+				break;
+			default:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_IO, "Format error"
+				);
+		}
+	}
+
+	passphrase_screen->width = width;
+	passphrase_screen->height = height;
+
+	if(false
+		|| (size_t)width * height / 8 != device->passphrase_screen_size
+		|| (!has_image && !device->passphrase_screen_cached)
+		|| (delta && !has_hash)
+	)
+	{
+		device->passphrase_screen_cached = false;
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		);
+	}
+
+	if(has_image)
+	{
+		passphrase_screen->dirty = (hakomari_rect_t){
+			.width = width, .height = height
+		};
+	}
+
+	if(delta)
+	{
+		// Make sure the cache is in sync with the device
+		uint64_t cached_hash = hakomari_hash(
+			passphrase_screen->image_data, device->passphrase_screen_size
+		);
+		if(cached_hash != hash)
+		{
+			device->passphrase_screen_cached = false;
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Passphrase screen out of sync"
+			);
+		}
+
+		device->passphrase_screen_hash = hash;
+		device->passphrase_screen_cached = true;
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_ask_passphrase(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint
+)
+{
+	hakomari_error_t error;
+	hakomari_auth_handler_t* auth_handler = device->ctx->auth_handler;
+
+	if(auth_handler == NULL)
+	{
+		return HAKOMARI_ERR_AUTH_REQUIRED;
+	}
+
+	error = hakomari_fetch_passphrase_screen(device, endpoint);
+	if(error != HAKOMARI_OK) { return error; }
+
+	// Actual passphrase prompt
+	hakomari_auth_ctx_t auth_ctx = {
+		.device = device,
+		.endpoint = endpoint,
+		.passphrase_inputed = false,
+		.num_pending_events = 0,
+	};
+
+	error = hakomari_begin_query(device, endpoint, "@input-passphrase");
+	if(error != HAKOMARI_OK) { return error; }
+
+	if(hakomari_flush_output(device) != SLIPPER_OK)
+	{
+		return HAKOMARI_ERR_IO;
+	}
+
+	error = auth_handler->ask_passphrase(auth_handler->userdata, &auth_ctx);
+	if(error != HAKOMARI_OK) { return error; }
+
+	error = hakomari_flush_passphrase_input(&auth_ctx);
+	if(error != HAKOMARI_OK) { return error; }
+
+	// Mark end of input stream
+	if(!cmp_write_nil(&device->cmp)) { return hakomari_set_cmp_error(device); }
+
+	error = hakomari_end_query(device, NULL);
+	if(error != HAKOMARI_OK) { return error; }
+
+	return hakomari_set_last_error(
+		device->ctx,
+		auth_ctx.passphrase_inputed ? HAKOMARI_OK : HAKOMARI_ERR_AUTH_REQUIRED,
+		NULL
+	);
+}
+
+static hakomari_error_t
+hakomari_preauthorize(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint
+)
+{
+	hakomari_error_t error;
+	do
+	{
+		error = hakomari_query_endpoint_once(
+			device, endpoint, "@auth-status", NULL, NULL, 0, false, NULL
+		);
+	} while(true
+		&& error == HAKOMARI_ERR_AUTH_REQUIRED
+		&& hakomari_ask_passphrase(device, endpoint) == HAKOMARI_OK
+	);
+
+	return error;
+}
+
+static hakomari_error_t
+hakomari_bind_endpoint(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint
+)
+{
+	uint32_t* handle = hakomari_find_endpoint_handle(device, endpoint);
+	if(false
+		|| !(device->caps & HAKOMARI_CAP_BIND)
+		|| handle == NULL
+		|| *handle != HAKOMARI_HANDLE_UNBOUND
+	)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	hakomari_error_t error = hakomari_query_endpoint_once(
+		device, endpoint, "@bind", NULL, NULL, 0, false, NULL
+	);
+	if(error == HAKOMARI_ERR_IO) { return error; }
+
+	// The endpoint is still there, binding is retried once authenticated
+	if(error == HAKOMARI_ERR_AUTH_REQUIRED)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	// Otherwise, fall back to strings for the rest of this generation
+	uint32_t bound_handle;
+	bool bound = true
+		&& error == HAKOMARI_OK
+		&& cmp_read_uint(&device->cmp, &bound_handle)
+		&& bound_handle < HAKOMARI_HANDLE_FAILED;
+	*handle = bound ? bound_handle : HAKOMARI_HANDLE_FAILED;
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static const uint32_t HAKOMARI_SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint64_t HAKOMARI_SHA512_K[80] = {
+	0x428a2f98d728ae22, 0x7137449123ef65cd, 0xb5c0fbcfec4d3b2f, 0xe9b5dba58189dbbc,
+	0x3956c25bf348b538, 0x59f111f1b605d019, 0x923f82a4af194f9b, 0xab1c5ed5da6d8118,
+	0xd807aa98a3030242, 0x12835b0145706fbe, 0x243185be4ee4b28c, 0x550c7dc3d5ffb4e2,
+	0x72be5d74f27b896f, 0x80deb1fe3b1696b1, 0x9bdc06a725c71235, 0xc19bf174cf692694,
+	0xe49b69c19ef14ad2, 0xefbe4786384f25e3, 0x0fc19dc68b8cd5b5, 0x240ca1cc77ac9c65,
+	0x2de92c6f592b0275, 0x4a7484aa6ea6e483, 0x5cb0a9dcbd41fbd4, 0x76f988da831153b5,
+	0x983e5152ee66dfab, 0xa831c66d2db43210, 0xb00327c898fb213f, 0xbf597fc7beef0ee4,
+	0xc6e00bf33da88fc2, 0xd5a79147930aa725, 0x06ca6351e003826f, 0x142929670a0e6e70,
+	0x27b70a8546d22ffc, 0x2e1b21385c26c926, 0x4d2c6dfc5ac42aed, 0x53380d139d95b3df,
+	0x650a73548baf63de, 0x766a0abb3c77b2a8, 0x81c2c92e47edaee6, 0x92722c851482353b,
+	0xa2bfe8a14cf10364, 0xa81a664bbc423001, 0xc24b8b70d0f89791, 0xc76c51a30654be30,
+	0xd192e819d6ef5218, 0xd69906245565a910, 0xf40e35855771202a, 0x106aa07032bbd1b8,
+	0x19a4c116b8d2d0c8, 0x1e376c085141ab53, 0x2748774cdf8eeb99, 0x34b0bcb5e19b48a8,
+	0x391c0cb3c5c95a63, 0x4ed8aa4ae3418acb, 0x5b9cca4f7763e373, 0x682e6ff3d6b2b8a3,
+	0x748f82ee5defb2fc, 0x78a5636f43172f60, 0x84c87814a1f0ab72, 0x8cc702081a6439ec,
+	0x90befffa23631e28, 0xa4506cebde82bde9, 0xbef9a3f7b2c67915, 0xc67178f2e372532b,
+	0xca273eceea26619c, 0xd186b8c721c0c207, 0xeada7dd6cde0eb1e, 0xf57d4f7fee6ed178,
+	0x06f067aa72176fba, 0x0a637dc5a2c898a6, 0x113f9804bef90dae, 0x1b710b35131c471b,
+	0x28db77f523047d84, 0x32caab7b40c72493, 0x3c9ebe0a15c9bebc, 0x431d67c49c100d4c,
+	0x4cc5d4becb3e42b6, 0x597f299cfc657e2a, 0x5fcb6fab3ad6faec, 0x6c44198c4a475817,
+};
+
+static inline uint32_t
+hakomari_load32_be(const uint8_t* data)
+{
+	return ((uint32_t)data[0] << 24)
+		| ((uint32_t)data[1] << 16)
+		| ((uint32_t)data[2] << 8)
+		| (uint32_t)data[3];
+}
+
+static inline uint64_t
+hakomari_load64_be(const uint8_t* data)
+{
+	return ((uint64_t)hakomari_load32_be(data) << 32)
+		| hakomari_load32_be(data + 4);
+}
+
+static inline void
+hakomari_store64_be(uint8_t* data, uint64_t value)
+{
+	for(int i = 7; i >= 0; --i)
+	{
+		data[i] = (uint8_t)value;
+		value >>= 8;
+	}
+}
+
+#define HAKOMARI_ROTR32(X, N) (((X) >> (N)) | ((X) << (32 - (N))))
+#define HAKOMARI_ROTR64(X, N) (((X) >> (N)) | ((X) << (64 - (N))))
+
+#if defined(HAKOMARI_SHA_NI)
+#if defined(HAKOMARI_SHA_DISPATCH)
+__attribute__((target("sha,sse4.1")))
+#endif
+static void
+hakomari_sha256_blocks_ni(
+	uint32_t* state, const uint8_t* data, size_t num_blocks
+)
+{
+	const __m128i byte_swap = _mm_set_epi64x(
+		0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL
+	);
+
+	// The instructions want the state as ABEF and CDGH
+	__m128i cdab = _mm_shuffle_epi32(
+		_mm_loadu_si128((const __m128i*)&state[0]), 0xB1
+	);
+	__m128i efgh = _mm_shuffle_epi32(
+		_mm_loadu_si128((const __m128i*)&state[4]), 0x1B
+	);
+	__m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+	__m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+	for(; num_blocks > 0; --num_blocks, data += 64)
+	{
+		__m128i abef_in = abef;
+		__m128i cdgh_in = cdgh;
+
+		__m128i msg[4];
+		for(int i = 0; i < 4; ++i)
+		{
+			msg[i] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i*)(data + 16 * i)), byte_swap
+			);
+		}
+
+		// Four rounds per step. The schedule of step i + 4 is derived from
+		// the words of steps i to i + 3.
+		for(int i = 0; i < 16; ++i)
+		{
+			__m128i words = _mm_add_epi32(
+				msg[i & 3],
+				_mm_loadu_si128((const __m128i*)&HAKOMARI_SHA256_K[4 * i])
+			);
+			cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+			abef = _mm_sha256rnds2_epu32(
+				abef, cdgh, _mm_shuffle_epi32(words, 0x0E)
+			);
+
+			if(i < 12)
+			{
+				__m128i next = _mm_add_epi32(
+					_mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]),
+					_mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4)
+				);
+				msg[i & 3] = _mm_sha256msg2_epu32(next, msg[(i + 3) & 3]);
+			}
+		}
+
+		abef = _mm_add_epi32(abef, abef_in);
+		cdgh = _mm_add_epi32(cdgh, cdgh_in);
+	}
+
+	__m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+	__m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128(
+		(__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xF0)
+	);
+	_mm_storeu_si128(
+		(__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8)
+	);
+}
+#endif
+
+#if !defined(HAKOMARI_SHA_NI) || defined(HAKOMARI_SHA_DISPATCH)
+static void
+hakomari_sha256_blocks_scalar(
+	uint32_t* state, const uint8_t* data, size_t num_blocks
+)
+{
+	for(; num_blocks > 0; --num_blocks, data += 64)
+	{
+		uint32_t w[64];
+		for(int i = 0; i < 16; ++i)
+		{
+			w[i] = hakomari_load32_be(data + 4 * i);
+		}
+		for(int i = 16; i < 64; ++i)
+		{
+			uint32_t s0 = HAKOMARI_ROTR32(w[i - 15], 7)
+				^ HAKOMARI_ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = HAKOMARI_ROTR32(w[i - 2], 17)
+				^ HAKOMARI_ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for(int i = 0; i < 64; ++i)
+		{
+			uint32_t s1 = HAKOMARI_ROTR32(e, 6)
+				^ HAKOMARI_ROTR32(e, 11) ^ HAKOMARI_ROTR32(e, 25);
+			uint32_t ch = (e & f) ^ (~e & g);
+			uint32_t t1 = h + s1 + ch + HAKOMARI_SHA256_K[i] + w[i];
+			uint32_t s0 = HAKOMARI_ROTR32(a, 2)
+				^ HAKOMARI_ROTR32(a, 13) ^ HAKOMARI_ROTR32(a, 22);
+			uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + s0 + maj;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+#endif
+
+static void
+hakomari_sha256_blocks(uint32_t* state, const uint8_t* data, size_t num_blocks)
+{
+#if defined(HAKOMARI_SHA_DISPATCH)
+	// The compiler runtime probes the CPU once at startup
+	if(__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+	{
+		hakomari_sha256_blocks_ni(state, data, num_blocks);
+	}
+	else
+	{
+		hakomari_sha256_blocks_scalar(state, data, num_blocks);
+	}
+#elif defined(HAKOMARI_SHA_NI)
+	hakomari_sha256_blocks_ni(state, data, num_blocks);
+#else
+	hakomari_sha256_blocks_scalar(state, data, num_blocks);
+#endif
+}
+
+static void
+hakomari_sha512_blocks(uint64_t* state, const uint8_t* data, size_t num_blocks)
+{
+	for(; num_blocks > 0; --num_blocks, data += 128)
+	{
+		uint64_t w[80];
+		for(int i = 0; i < 16; ++i)
+		{
+			w[i] = hakomari_load64_be(data + 8 * i);
+		}
+		for(int i = 16; i < 80; ++i)
+		{
+			uint64_t s0 = HAKOMARI_ROTR64(w[i - 15], 1)
+				^ HAKOMARI_ROTR64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+			uint64_t s1 = HAKOMARI_ROTR64(w[i - 2], 19)
+				^ HAKOMARI_ROTR64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for(int i = 0; i < 80; ++i)
+		{
+			uint64_t s1 = HAKOMARI_ROTR64(e, 14)
+				^ HAKOMARI_ROTR64(e, 18) ^ HAKOMARI_ROTR64(e, 41);
+			uint64_t ch = (e & f) ^ (~e & g);
+			uint64_t t1 = h + s1 + ch + HAKOMARI_SHA512_K[i] + w[i];
+			uint64_t s0 = HAKOMARI_ROTR64(a, 28)
+				^ HAKOMARI_ROTR64(a, 34) ^ HAKOMARI_ROTR64(a, 39);
+			uint64_t maj = (a & b) ^ (a & c) ^ (b & c);
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + s0 + maj;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+}
+
+static void
+hakomari_digest_init(
+	struct hakomari_digest_ctx_s* ctx, hakomari_digest_t digest
+)
+{
+	static const uint32_t sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	static const uint64_t sha512_iv[8] = {
+		0x6a09e667f3bcc908, 0xbb67ae8584caa73b,
+		0x3c6ef372fe94f82b, 0xa54ff53a5f1d36f1,
+		0x510e527fade682d1, 0x9b05688c2b3e6c1f,
+		0x1f83d9abfb41bd6b, 0x5be0cd19137e2179,
+	};
+
+	ctx->digest = digest;
+	ctx->length = 0;
+	ctx->block_size = HAKOMARI_DIGESTS[digest].block_size;
+	ctx->block_used = 0;
+	if(digest == HAKOMARI_DIGEST_SHA256)
+	{
+		memcpy(ctx->state.sha256, sha256_iv, sizeof(sha256_iv));
+	}
+	else
+	{
+		memcpy(ctx->state.sha512, sha512_iv, sizeof(sha512_iv));
+	}
+}
+
+static void
+hakomari_digest_blocks(
+	struct hakomari_digest_ctx_s* ctx, const uint8_t* data, size_t num_blocks
+)
+{
+	if(ctx->digest == HAKOMARI_DIGEST_SHA256)
+	{
+		hakomari_sha256_blocks(ctx->state.sha256, data, num_blocks);
+	}
+	else
+	{
+		hakomari_sha512_blocks(ctx->state.sha512, data, num_blocks);
+	}
+}
+
+static void
+hakomari_digest_update(
+	struct hakomari_digest_ctx_s* ctx, const void* data, size_t size
+)
+{
+	const uint8_t* bytes = data;
+	ctx->length += size;
+
+	if(ctx->block_used > 0)
+	{
+		size_t fill = ctx->block_size - ctx->block_used;
+		if(fill > size) { fill = size; }
+		memcpy(ctx->block + ctx->block_used, bytes, fill);
+		ctx->block_used += fill;
+		bytes += fill;
+		size -= fill;
+
+		if(ctx->block_used < ctx->block_size) { return; }
+
+		hakomari_digest_blocks(ctx, ctx->block, 1);
+		ctx->block_used = 0;
+	}
+
+	// Whole blocks are hashed straight from the caller's memory
+	size_t num_blocks = size / ctx->block_size;
+	hakomari_digest_blocks(ctx, bytes, num_blocks);
+	bytes += num_blocks * ctx->block_size;
+	size -= num_blocks * ctx->block_size;
+
+	memcpy(ctx->block, bytes, size);
+	ctx->block_used = size;
+}
+
+static size_t
+hakomari_digest_final(struct hakomari_digest_ctx_s* ctx, uint8_t* out)
+{
+	// The bit length ends the last block: 64 bits for SHA-256 and 128 bits
+	// for SHA-512
+	size_t length_size = ctx->block_size / 8;
+	uint64_t length = ctx->length;
+
+	ctx->block[ctx->block_used++] = 0x80;
+	if(ctx->block_used > ctx->block_size - length_size)
+	{
+		memset(
+			ctx->block + ctx->block_used, 0, ctx->block_size - ctx->block_used
+		);
+		hakomari_digest_blocks(ctx, ctx->block, 1);
+		ctx->block_used = 0;
+	}
+
+	memset(ctx->block + ctx->block_used, 0, ctx->block_size - ctx->block_used);
+	hakomari_store64_be(ctx->block + ctx->block_size - 8, length << 3);
+	if(length_size > 8)
+	{
+		hakomari_store64_be(ctx->block + ctx->block_size - 16, length >> 61);
+	}
+	hakomari_digest_blocks(ctx, ctx->block, 1);
+
+	size_t size = HAKOMARI_DIGESTS[ctx->digest].size;
+	for(size_t i = 0; i < size / 4; ++i)
+	{
+		uint32_t word = ctx->digest == HAKOMARI_DIGEST_SHA256
+			? ctx->state.sha256[i]
+			: (uint32_t)(ctx->state.sha512[i / 2] >> (i % 2 ? 0 : 32));
+		out[4 * i] = (uint8_t)(word >> 24);
+		out[4 * i + 1] = (uint8_t)(word >> 16);
+		out[4 * i + 2] = (uint8_t)(word >> 8);
+		out[4 * i + 3] = (uint8_t)word;
+	}
+
+	return size;
+}
+
+struct hakomari_summary_s
+{
+	uint8_t data[HAKOMARI_DIGEST_SUMMARY_SIZE];
+	size_t size;
+};
+
+static size_t
+hakomari_summary_write(cmp_ctx_t* ctx, const void* data, size_t count)
+{
+	struct hakomari_summary_s* summary = ctx->buf;
+	if(count > sizeof(summary->data) - summary->size) { return 0; }
+
+	memcpy(summary->data + summary->size, data, count);
+	summary->size += count;
+	return count;
+}
+
+static hakomari_error_t
+hakomari_hash_payload(
+	hakomari_device_t* device, hakomari_input_t* payload,
+	struct hakomari_digest_ctx_s* digest_ctx
+)
+{
+	// A borrowed span is hashed in place, the document is never copied
+	if(payload->peek != NULL && payload->consume != NULL)
+	{
+		while(true)
+		{
+			const void* data;
+			size_t size;
+			if(payload->peek(payload->userdata, &data, &size) != HAKOMARI_OK)
+			{
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_IO, "Error while reading payload"
+				);
+			}
+
+			if(size == 0) { break; }
+
+			hakomari_digest_update(digest_ctx, data, size);
+
+			if(payload->consume(payload->userdata, size) != HAKOMARI_OK)
+			{
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_INVALID, "Invalid payload stream"
+				);
+			}
+		}
+
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	size_t size;
+	do
+	{
+		uint8_t* buf = device->payload_chunk;
+		size_t chunk_size = device->payload_chunk_size;
+		size = chunk_size;
+		switch(hakomari_read(payload, buf, &size))
+		{
+			case HAKOMARI_OK:
+				hakomari_digest_update(digest_ctx, buf, size);
+
+				// Fewer, larger reads for a large document
+				if(size == chunk_size)
+				{
+					hakomari_grow_payload_chunk(device, chunk_size * 2);
+				}
+				break;
+			case HAKOMARI_ERR_IO:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_IO, "Error while reading payload"
+				);
+			case HAKOMARI_ERR_MEMORY:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_MEMORY, NULL
+				);
+			default:
+				return hakomari_set_last_error(
+					device->ctx, HAKOMARI_ERR_INVALID, "Invalid payload stream"
+				);
+		}
+	} while(size);
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_summarize_payload(
+	hakomari_device_t* device, hakomari_digest_t digest,
+	hakomari_input_t* payload, struct hakomari_summary_s* summary
+)
+{
+	struct hakomari_digest_ctx_s digest_ctx;
+	hakomari_digest_init(&digest_ctx, digest);
+
+	hakomari_error_t error;
+	if((error = hakomari_hash_payload(
+		device, payload, &digest_ctx
+	)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	uint8_t value[HAKOMARI_DIGEST_MAX_SIZE];
+	size_t value_size = hakomari_digest_final(&digest_ctx, value);
+	const char* name = HAKOMARI_DIGESTS[digest].name;
+
+	// [str algorithm, u64 length, bin digest]
+	cmp_ctx_t cmp;
+	summary->size = 0;
+	cmp_init(&cmp, summary, NULL, NULL, hakomari_summary_write);
+	if(false
+		|| !cmp_write_array(&cmp, 3)
+		|| !cmp_write_str(&cmp, name, strlen(name))
+		|| !cmp_write_u64(&cmp, digest_ctx.length)
+		|| !cmp_write_bin(&cmp, value, value_size)
+	)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, cmp_strerror(&cmp)
+		);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_query(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
+	const char* query, const hakomari_prepared_query_t* prepared,
+	hakomari_input_t* payload, uint8_t flags, hakomari_input_t** result
+)
+{
+	if(false
+		|| hakomari_negotiate(device) != HAKOMARI_OK
+		|| hakomari_bind_endpoint(device, endpoint) != HAKOMARI_OK
+	)
+	{
+		return device->ctx->last_error;
+	}
+
+	if(payload != NULL && (device->caps & HAKOMARI_CAP_AUTH_STATUS))
+	{
+		hakomari_error_t error;
+		if((error = hakomari_preauthorize(device, endpoint)) != HAKOMARI_OK)
+		{
+			return error;
+		}
+
+		// The passphrase was already obtained: stream without recording
+		return hakomari_query_endpoint_once(
+			device, endpoint, query, prepared, payload, flags, false, result
+		);
+	}
+
+	HAKOMARI_WITH_AUTH(
+		hakomari_query_endpoint_authenticated,
+		device, endpoint, query, prepared, payload, flags, result
+	);
+}
+
+static hakomari_error_t
+hakomari_cache_key(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
+	const char* query, hakomari_input_t* payload
+)
+{
+	struct hakomari_cache_s* cache = &device->cache;
+	struct hakomari_mem_stream_s* key = &cache->pending;
+	hakomari_mem_stream_reset(key);
+
+	// [has endpoint, (type, name), query, has payload, (SHA-256 of payload)]
+	uint8_t has_endpoint = endpoint != NULL;
+	uint8_t has_payload = payload != NULL;
+	if(!(true
+		&& hakomari_mem_stream_write(key, &has_endpoint, 1)
+		&& (!has_endpoint || (true
+			&& hakomari_mem_stream_write(
+				key, endpoint->type, strlen(endpoint->type) + 1
+			)
+			&& hakomari_mem_stream_write(
+				key, endpoint->name, strlen(endpoint->name) + 1
+			)
+		))
+		&& hakomari_mem_stream_write(key, query, strlen(query) + 1)
+		&& hakomari_mem_stream_write(key, &has_payload, 1)
+	))
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_MEMORY, NULL);
+	}
+
+	if(payload != NULL)
+	{
+		struct hakomari_digest_ctx_s digest_ctx;
+		hakomari_digest_init(&digest_ctx, HAKOMARI_DIGEST_SHA256);
+
+		hakomari_error_t error;
+		if((error = hakomari_hash_payload(
+			device, payload, &digest_ctx
+		)) != HAKOMARI_OK)
+		{
+			return error;
+		}
+
+		if(payload->rewind(payload->userdata) != HAKOMARI_OK)
+		{
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Error while rewinding payload"
+			);
+		}
+
+		uint8_t digest[HAKOMARI_DIGEST_MAX_SIZE];
+		size_t digest_size = hakomari_digest_final(&digest_ctx, digest);
+		if(!hakomari_mem_stream_write(key, digest, digest_size))
+		{
+			return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_MEMORY, NULL);
+		}
+	}
+
+	cache->pending_key_size = key->write_pos;
+	cache->pending_hash = hakomari_hash(key->buff, key->write_pos);
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static struct hakomari_cache_entry_s*
+hakomari_cache_find(hakomari_device_t* device)
+{
+	struct hakomari_cache_s* cache = &device->cache;
+	uint64_t now = hakomari_now_ms();
+	for(
+		struct hakomari_cache_entry_s* entry = cache->head;
+		entry != NULL;
+		entry = entry->next
+	)
+	{
+		if(false
+			|| entry->hash != cache->pending_hash
+			|| entry->key_size != cache->pending_key_size
+			|| memcmp(entry->data, cache->pending.buff, entry->key_size) != 0
+		)
+		{
+			continue;
+		}
+
+		if(now >= entry->expires_at)
+		{
+			hakomari_cache_remove(device, entry);
+			return NULL;
+		}
+
+		hakomari_cache_unlink(cache, entry);
+		hakomari_cache_push_front(cache, entry);
+		return entry;
+	}
+
+	return NULL;
+}
+
+static void
+hakomari_cache_insert(hakomari_device_t* device)
+{
+	struct hakomari_cache_s* cache = &device->cache;
+	size_t size = cache->pending.write_pos;
+	size_t entry_size = sizeof(struct hakomari_cache_entry_s) + size;
+	if(false
+		|| cache->pending.overflowed
+		|| cache->pending_generation != device->endpoint_generation
+		|| entry_size > cache->capacity
+	)
+	{
+		return;
+	}
+
+	// The least recently used results make room
+	while(cache->used + entry_size > cache->capacity)
+	{
+		hakomari_cache_remove(device, cache->tail);
+	}
+
+	struct hakomari_cache_entry_s* entry = hakomari_device_malloc(
+		device, entry_size
+	);
+	if(entry == NULL) { return; }
+
+	entry->hash = cache->pending_hash;
+	entry->expires_at = hakomari_now_ms() + cache->pending_ttl_ms;
+	entry->key_size = cache->pending_key_size;
+	entry->value_size = size - cache->pending_key_size;
+	memcpy(entry->data, cache->pending.buff, size);
+	hakomari_cache_push_front(cache, entry);
+	cache->used += entry_size;
+}
+
+static hakomari_error_t
+hakomari_cache_recorder_read(void* userdata, void* buf, size_t* size)
+{
+	hakomari_device_t* device = userdata;
+	struct hakomari_cache_s* cache = &device->cache;
+	size_t requested = *size;
+	hakomari_error_t error = hakomari_device_read(device, buf, size);
+	if(!cache->recording) { return error; }
+
+	if(error != HAKOMARI_OK)
+	{
+		cache->recording = false;
+	}
+	else if(*size > 0 && !hakomari_mem_stream_write(&cache->pending, buf, *size))
+	{
+		// Past the bound, the stream stops recording and is not stored
+		cache->recording = false;
+	}
+	else if(*size < requested || hakomari_rx_exhausted(device))
+	{
+		// The caller read the whole result
+		cache->recording = false;
+		hakomari_cache_insert(device);
+	}
+
+	return error;
+}
+
+static hakomari_error_t
+hakomari_query_cached(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
+	const char* query, const hakomari_prepared_query_t* prepared,
+	hakomari_input_t* payload, hakomari_input_t** result
+)
+{
+	struct hakomari_cache_s* cache = &device->cache;
+	const char* name = prepared != NULL ? prepared->query : query;
+	uint32_t ttl_ms = 0;
+
+	// The payload is read once for its key so it must be rewindable
+	if(false
+		|| result == NULL
+		|| (payload != NULL && payload->rewind == NULL)
+		|| !hakomari_cache_ttl(device, endpoint, name, &ttl_ms)
+	)
+	{
+		return hakomari_query(
+			device, endpoint, query, prepared, payload, 0, result
+		);
+	}
+
+	// Endpoints may have been destroyed or replaced since
+	if(cache->generation != device->endpoint_generation)
+	{
+		hakomari_cache_flush(device);
+		cache->generation = device->endpoint_generation;
+	}
+
+	hakomari_error_t error;
+	if((error = hakomari_cache_key(
+		device, endpoint, name, payload
+	)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	struct hakomari_cache_entry_s* entry = hakomari_cache_find(device);
+	if(entry != NULL)
+	{
+		hakomari_init_memory_input(
+			&cache->hit, device->ctx,
+			entry->data + entry->key_size, entry->value_size
+		);
+		*result = &cache->hit.input;
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	if((error = hakomari_query(
+		device, endpoint, query, prepared, payload, 0, result
+	)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	// The result is stored once the caller has read all of it
+	cache->recording = true;
+	cache->pending_ttl_ms = ttl_ms;
+	cache->pending_generation = device->endpoint_generation;
+	cache->recorder = (hakomari_input_t){
+		.userdata = device,
+		.read = hakomari_cache_recorder_read,
+	};
+	*result = &cache->recorder;
+
+	if(hakomari_rx_exhausted(device))
+	{
+		cache->recording = false;
+		hakomari_cache_insert(device);
+	}
+
+	return error;
+}
+
+hakomari_error_t
+hakomari_query_endpoint(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
+	const hakomari_string_t query, hakomari_input_t* payload,
+	hakomari_input_t** result
+)
+{
+	return hakomari_query_cached(device, endpoint, query, NULL, payload, result);
+}
+
+hakomari_error_t
+hakomari_query_endpoint_digest(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
+	const hakomari_string_t query, hakomari_digest_t digest,
+	hakomari_input_t* payload, hakomari_input_t** result
+)
+{
+	if(false
+		|| endpoint == NULL
+		|| payload == NULL
+		|| (size_t)digest >= sizeof(HAKOMARI_DIGESTS) / sizeof(HAKOMARI_DIGESTS[0])
+	)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	if(hakomari_negotiate(device) != HAKOMARI_OK)
+	{
+		return device->ctx->last_error;
+	}
+
+	// Without support on both sides, the device hashes the document itself
+	if(false
+		|| !(device->caps & HAKOMARI_CAP_DIGEST_SIGN)
+		|| !(endpoint->digests & (1u << digest))
+	)
+	{
+		return hakomari_query(device, endpoint, query, NULL, payload, 0, result);
+	}
+
+	struct hakomari_summary_s summary;
+	hakomari_error_t error;
+	if((error = hakomari_summarize_payload(
+		device, digest, payload, &summary
+	)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	// The summary is rewindable so authentication never reads the
+	// document again
+	struct hakomari_memory_input_s summary_input;
+	hakomari_init_memory_input(
+		&summary_input, device->ctx, summary.data, summary.size
+	);
+
+	return hakomari_query(
+		device, endpoint, query, NULL, &summary_input.input,
+		HAKOMARI_REQUEST_DIGEST, result
+	);
+}
+
+hakomari_error_t
+hakomari_set_query_cache(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
+	const char* query, unsigned int ttl_ms
+)
+{
+	if(device->cache.capacity == 0)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_INVALID, "Result cache is disabled"
+		);
+	}
+
+	if(query != NULL && strlen(query) >= sizeof(hakomari_string_t))
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	struct hakomari_cache_rule_s rule = {
+		.any_endpoint = endpoint == NULL,
+		.any_query = query == NULL,
+		.ttl_ms = ttl_ms,
+	};
+	if(endpoint != NULL)
+	{
+		memcpy(rule.type, endpoint->type, sizeof(rule.type));
+		memcpy(rule.name, endpoint->name, sizeof(rule.name));
+	}
+	if(query != NULL) { memcpy(rule.query, query, strlen(query) + 1); }
+
+	if(!hakomari_add_cache_rule(device, &rule))
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_MEMORY, NULL);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+void
+hakomari_clear_query_cache(hakomari_device_t* device)
+{
+	hakomari_cache_flush(device);
+}
+
+static bool
+hakomari_same_endpoint(
+	const hakomari_endpoint_desc_t* lhs, const hakomari_endpoint_desc_t* rhs
+)
+{
+	if(lhs == rhs) { return true; }
+
+	return true
+		&& lhs != NULL
+		&& rhs != NULL
+		&& strcmp(lhs->type, rhs->type) == 0
+		&& strcmp(lhs->name, rhs->name) == 0;
+}
+
+static const hakomari_endpoint_desc_t*
+hakomari_prepared_endpoint(const hakomari_prepared_query_t* prepared)
+{
+	if(!prepared->has_endpoint) { return NULL; }
+
+	// Refer to the table entry when there is one so that its handle is used
+	hakomari_device_t* device = prepared->device;
+	return prepared->endpoint_index < device->num_endpoints
+		? &device->endpoints[prepared->endpoint_index]
+		: &prepared->endpoint;
+}
+
+static hakomari_error_t
+hakomari_encode_prepared_query(hakomari_prepared_query_t* prepared)
+{
+	hakomari_device_t* device = prepared->device;
+
+	// The endpoint is looked up by type and name since the table may have
+	// been enumerated again since it was prepared
+	prepared->endpoint_index = UINT32_MAX;
+	for(uint32_t i = 0; prepared->has_endpoint && i < device->num_endpoints; ++i)
+	{
+		if(hakomari_same_endpoint(&device->endpoints[i], &prepared->endpoint))
+		{
+			prepared->endpoint_index = i;
+			break;
+		}
+	}
+
+	// Bind first so that the handle is part of the encoded header
+	const hakomari_endpoint_desc_t* endpoint = hakomari_prepared_endpoint(prepared);
+	if(hakomari_bind_endpoint(device, endpoint) != HAKOMARI_OK)
+	{
+		return device->ctx->last_error;
+	}
+
+	// Encode the header into the scratch buffer. It always fits since every
+	// string is bounded by hakomari_string_t.
+	hakomari_reset_cmp(device);
+	device->tx_size = 0;
+	hakomari_error_t error;
+	if((error = hakomari_write_request_header(
+		device, endpoint, prepared->query, 0, 0
+	)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	size_t header_size = device->tx_size;
+	device->tx_size = 0;
+	prepared->handle = hakomari_endpoint_handle(device, endpoint);
+	prepared->endpoint_generation = device->endpoint_generation;
+
+	// The array, u8 frame type and u32 markers precede the txid
+	size_t txid_end = 1 + 2 + 1 + sizeof(uint32_t);
+	size_t txid_start = txid_end - sizeof(uint32_t);
+
+	// COBS blocks depend on what surrounds them so they cannot be
+	// precomputed: keep the header as is
+	prepared->escaped = device->slipper.cfg.framing == SLIPPER_FRAMING_SLIP;
+	if(prepared->escaped)
+	{
+		prepared->prefix_size = slipper_escape(
+			prepared->header, device->tx_buf, txid_start
+		);
+		prepared->suffix_size = slipper_escape(
+			prepared->header + prepared->prefix_size,
+			device->tx_buf + txid_end, header_size - txid_end
+		);
+	}
+	else
+	{
+		prepared->prefix_size = txid_start;
+		prepared->suffix_size = header_size - txid_end;
+		memcpy(prepared->header, device->tx_buf, txid_start);
+		memcpy(
+			prepared->header + txid_start,
+			device->tx_buf + txid_end, prepared->suffix_size
+		);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+hakomari_error_t
+hakomari_prepare_query(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
+	const hakomari_string_t query, hakomari_prepared_query_t** prepared_ptr
+)
+{
+	if(false
+		|| query == NULL
+		|| prepared_ptr == NULL
+		|| strlen(query) >= sizeof(hakomari_string_t)
+	)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	if(hakomari_negotiate(device) != HAKOMARI_OK)
+	{
+		return device->ctx->last_error;
 	}
 
-	if(map_size != 2)
+	// Reserve room for the largest header so that it can be encoded again in
+	// place whenever the endpoint table changes
+	size_t prepared_size = sizeof(hakomari_prepared_query_t)
+		+ 2 * HAKOMARI_TX_BUF_SIZE;
+	hakomari_prepared_query_t* prepared = device->static_storage
+		? hakomari_pool_alloc(&device->prepared_query_pool, prepared_size)
+		: hakomari_device_malloc(device, prepared_size);
+	if(prepared == NULL)
 	{
-		return hakomari_set_last_error(
-			device->ctx, HAKOMARI_ERR_IO, "Format error"
-		);
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_MEMORY, NULL);
 	}
 
-	memset(desc->type, 0, sizeof(desc->type));
-	memset(desc->name, 0, sizeof(desc->name));
+	*prepared = (hakomari_prepared_query_t){
+		.device = device,
+		.has_endpoint = endpoint != NULL,
+	};
+	if(endpoint != NULL) { prepared->endpoint = *endpoint; }
+	memcpy(prepared->query, query, strlen(query) + 1);
 
-	for(uint32_t i = 0; i < map_size; ++i)
+	if(hakomari_encode_prepared_query(prepared) != HAKOMARI_OK)
 	{
-		hakomari_string_t key;
-		uint32_t size = sizeof(key);
-		if(!cmp_read_str(&device->cmp, key, &size))
-		{
-			return hakomari_set_cmp_error(device);
-		}
+		hakomari_destroy_prepared_query(prepared);
+		return device->ctx->last_error;
+	}
 
-		char* value = NULL;
-		if(strcmp(key, "type") == 0)
-		{
-			value = desc->type;
-		}
-		else if(strcmp(key, "name") == 0)
-		{
-			value = desc->name;
-		}
-		else
-		{
-			return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_IO, "Format error");
-		}
+	*prepared_ptr = prepared;
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
 
-		size = sizeof(hakomari_string_t);
-		if(!cmp_read_str(&device->cmp, value, &size))
+hakomari_error_t
+hakomari_query_prepared(
+	hakomari_prepared_query_t* prepared, hakomari_input_t* payload,
+	hakomari_input_t** result
+)
+{
+	// Encode the header again when the endpoint table changed or the
+	// endpoint got bound since
+	hakomari_device_t* device = prepared->device;
+	if(false
+		|| prepared->endpoint_generation != device->endpoint_generation
+		|| prepared->handle != hakomari_endpoint_handle(
+			device, hakomari_prepared_endpoint(prepared)
+		)
+	)
+	{
+		if(hakomari_encode_prepared_query(prepared) != HAKOMARI_OK)
 		{
-			return hakomari_set_cmp_error(device);
+			return device->ctx->last_error;
 		}
 	}
 
-	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	return hakomari_query_cached(
+		device, hakomari_prepared_endpoint(prepared),
+		NULL, prepared, payload, result
+	);
 }
 
-hakomari_error_t
-hakomari_inspect_endpoint(
-	hakomari_device_t* device,
-	size_t index, const hakomari_endpoint_desc_t** endpoint
-)
+void
+hakomari_destroy_prepared_query(hakomari_prepared_query_t* prepared)
 {
-	if(index > device->num_endpoints || device == NULL)
+	hakomari_device_t* device = prepared->device;
+	if(device->static_storage)
 	{
-		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
+		hakomari_pool_free(&device->prepared_query_pool, prepared);
+	}
+	else
+	{
+		hakomari_device_free(device, prepared);
 	}
+}
 
-	*endpoint = &device->endpoints[index];
+static void
+hakomari_fail_batch(
+	hakomari_error_t* statuses, size_t num_items, hakomari_error_t error
+)
+{
+	for(size_t i = 0; i < num_items; ++i) { statuses[i] = error; }
+}
 
-	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+static hakomari_error_t
+hakomari_handle_batch_result(
+	const hakomari_batch_item_t* item,
+	hakomari_error_t status, hakomari_input_t* result
+)
+{
+	if(status != HAKOMARI_OK || item->handle_result == NULL) { return status; }
+
+	return item->handle_result(item->userdata, result);
 }
 
 static hakomari_error_t
-hakomari_begin_query(
-	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
-	const hakomari_string_t query
+hakomari_send_batch(
+	hakomari_device_t* device,
+	const hakomari_batch_item_t* items, size_t num_items,
+	hakomari_error_t* statuses
 )
 {
-	hakomari_reset_cmp(device);
+	// Reads and writes share slipper's buffer: the whole burst leaves
+	// before the first reply is read.
+	uint32_t first_txid = device->txid;
+	hakomari_error_t error;
+	for(size_t i = 0; i < num_items; ++i)
+	{
+		const hakomari_batch_item_t* item = &items[i];
+		bool compressed = hakomari_use_compression(device, item->payload);
+		hakomari_input_t* source = compressed
+			? hakomari_begin_compression(device, item->payload, false)
+			: item->payload;
+		if(false
+			|| (error = hakomari_begin_frame(device, i > 0)) != HAKOMARI_OK
+			|| (error = hakomari_write_request_header(
+				device, item->endpoint, item->query, device->txid++,
+				compressed ? HAKOMARI_REQUEST_COMPRESSED : 0
+			)) != HAKOMARI_OK
+			|| (true
+				&& source != NULL
+				&& (error = hakomari_send_payload(
+					device, source, false
+				)) != HAKOMARI_OK
+			)
+		)
+		{
+			hakomari_fail_batch(statuses, num_items, error);
+			return error;
+		}
+
+		if(hakomari_flush_request(device) != SLIPPER_OK)
+		{
+			hakomari_fail_batch(statuses, num_items, HAKOMARI_ERR_IO);
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_IO, "Error while sending request"
+			);
+		}
+	}
 
-	if(slipper_begin_write(&device->slipper, HAKOMARI_DEVICE_TIMEOUT) != SLIPPER_OK)
+	if(slipper_end_write(&device->slipper, HAKOMARI_DEVICE_TIMEOUT) != SLIPPER_OK)
 	{
+		hakomari_fail_batch(statuses, num_items, HAKOMARI_ERR_IO);
 		return hakomari_set_last_error(
-			device->ctx, HAKOMARI_ERR_IO, "Error writing message start"
+			device->ctx, HAKOMARI_ERR_IO, "Error while sending request"
 		);
 	}
 
-	if(false
-		|| !cmp_write_array(&device->cmp, 4)
-		|| !cmp_write_u8(&device->cmp, HAKOMARI_FRAME_REQ)
-		|| !cmp_write_u32(&device->cmp, device->txid++)
-		|| !cmp_write_str(&device->cmp, query, strlen(query))
-	)
+	if(hakomari_drain(device) != HAKOMARI_OK)
 	{
-		return hakomari_set_cmp_error(device);
+		hakomari_fail_batch(statuses, num_items, device->ctx->last_error);
+		return device->ctx->last_error;
 	}
 
-	if(desc)
-	{
-		if(false
-			|| !cmp_write_array(&device->cmp, 2)
-			|| !cmp_write_str(&device->cmp, desc->type, strlen(desc->type))
-			|| !cmp_write_str(&device->cmp, desc->name, strlen(desc->name))
-		)
-		{
-			return hakomari_set_cmp_error(device);
-		}
-	}
-	else
+	// Replies follow each other in the receive buffer
+	for(size_t i = 0; i < num_items; ++i)
 	{
-		if(!cmp_write_nil(&device->cmp))
+		hakomari_error_t status;
+		hakomari_input_t* result;
+		if(hakomari_read_reply(
+			device, first_txid + (uint32_t)i, i == 0, &status, &result
+		) != HAKOMARI_OK)
 		{
-			return hakomari_set_cmp_error(device);
+			error = device->ctx->last_error;
+			hakomari_fail_batch(statuses + i, num_items - i, error);
+			return error;
 		}
+
+		statuses[i] = hakomari_handle_batch_result(&items[i], status, result);
 	}
 
 	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
 }
 
 static hakomari_error_t
-hakomari_end_query(hakomari_device_t* device, hakomari_input_t** result)
+hakomari_authenticate_batch(
+	hakomari_device_t* device,
+	const hakomari_batch_item_t* items, hakomari_error_t* statuses,
+	size_t* num_done
+)
 {
-	hakomari_error_t status = HAKOMARI_OK;
-	slipper_error_t error;
-	if((error = slipper_end_write(&device->slipper, HAKOMARI_DEVICE_TIMEOUT)) != 0)
+	const hakomari_endpoint_desc_t* endpoint = items[0].endpoint;
+	*num_done = 0;
+
+	if(hakomari_bind_endpoint(device, endpoint) != HAKOMARI_OK)
 	{
-		return hakomari_set_last_error(
-			device->ctx, HAKOMARI_ERR_IO, slipper_errorstr(error)
-		);
+		return device->ctx->last_error;
 	}
 
-	while(true)
+	if(device->caps & HAKOMARI_CAP_AUTH_STATUS)
 	{
-		if(slipper_begin_read(
-			&device->slipper, HAKOMARI_DEVICE_TIMEOUT
-		) != SLIPPER_OK)
-		{
-			return device->ctx->last_error;
-		}
+		return hakomari_preauthorize(device, endpoint);
+	}
 
-		uint32_t size;
-		if(!cmp_read_array(&device->cmp, &size))
-		{
-			return hakomari_set_cmp_error(device);
-		}
+	// Only a query can tell whether the endpoint is locked: the first item
+	// authenticates on its own
+	hakomari_input_t* result = NULL;
+	hakomari_error_t status = hakomari_query(
+		device, endpoint, items[0].query, NULL, items[0].payload, 0, &result
+	);
+	statuses[0] = hakomari_handle_batch_result(&items[0], status, result);
+	*num_done = 1;
+
+	return status == HAKOMARI_ERR_IO || status == HAKOMARI_ERR_AUTH_REQUIRED
+		? status
+		: HAKOMARI_OK;
+}
+
+hakomari_error_t
+hakomari_query_batch(
+	hakomari_device_t* device,
+	const hakomari_batch_item_t* items, size_t num_items,
+	hakomari_error_t* statuses
+)
+{
+	if(num_items > 0 && (items == NULL || statuses == NULL))
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
 
-		if(size != 3)
+	for(size_t i = 0; i < num_items; ++i)
+	{
+		if(items[i].query == NULL)
 		{
 			return hakomari_set_last_error(
-				device->ctx, HAKOMARI_ERR_IO, "Format error"
+				device->ctx, HAKOMARI_ERR_INVALID, NULL
 			);
 		}
+	}
+
+	if(hakomari_negotiate(device) != HAKOMARI_OK)
+	{
+		return device->ctx->last_error;
+	}
 
-		uint8_t type;
-		if(!cmp_read_u8(&device->cmp, &type))
+	size_t begin = 0;
+	while(begin < num_items)
+	{
+		// Consecutive items for the same endpoint share its authentication
+		size_t end = begin + 1;
+		while(true
+			&& end < num_items
+			&& hakomari_same_endpoint(items[end].endpoint, items[begin].endpoint)
+		)
 		{
-			return hakomari_set_cmp_error(device);
+			++end;
 		}
 
-		if(type != HAKOMARI_FRAME_REP)
+		size_t num_done;
+		hakomari_error_t error = hakomari_authenticate_batch(
+			device, items + begin, statuses + begin, &num_done
+		);
+		begin += num_done;
+
+		if(error == HAKOMARI_ERR_IO)
 		{
-			return hakomari_set_last_error(
-				device->ctx, HAKOMARI_ERR_IO, "Format error"
-			);
+			hakomari_fail_batch(statuses + begin, num_items - begin, error);
+			return error;
 		}
-
-		uint32_t txid;
-		if(!cmp_read_u32(&device->cmp, &txid))
+		else if(error != HAKOMARI_OK)
 		{
-			return hakomari_set_cmp_error(device);
+			hakomari_fail_batch(statuses + begin, end - begin, error);
+			begin = end;
+			continue;
 		}
 
-		if(txid != (device->txid - 1))
+		while(begin < end)
 		{
-			if(slipper_end_read(
-				&device->slipper, HAKOMARI_DEVICE_TIMEOUT
-			) != SLIPPER_OK)
+			size_t burst_size = end - begin;
+			if(burst_size > device->batch_window)
 			{
-				return hakomari_set_last_error(
-					device->ctx, HAKOMARI_ERR_IO, "Error while reading reply"
-				);
+				burst_size = device->batch_window;
 			}
 
-			hakomari_reset_cmp(device);
-			continue;
-		}
+			if((error = hakomari_send_batch(
+				device, items + begin, burst_size, statuses + begin
+			)) != HAKOMARI_OK)
+			{
+				begin += burst_size;
+				hakomari_fail_batch(statuses + begin, num_items - begin, error);
+				return error;
+			}
 
-		uint8_t result;
-		if(!cmp_read_u8(&device->cmp, &result))
-		{
-			return hakomari_set_cmp_error(device);
+			begin += burst_size;
 		}
-
-		status = (hakomari_error_t)result;
-		break;
 	}
 
-	if(result)
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+hakomari_error_t
+hakomari_inspect_passphrase_screen(
+	hakomari_auth_ctx_t* auth_ctx,
+	const hakomari_passphrase_screen_t** screen_ptr
+)
+{
+	if(screen_ptr == NULL || auth_ctx == NULL)
 	{
-		*result = status == HAKOMARI_OK ? &device->result : NULL;
+		return hakomari_set_last_error(
+			auth_ctx->device->ctx, HAKOMARI_ERR_INVALID, NULL
+		);
 	}
 
-	return hakomari_set_last_error(device->ctx, status, NULL);
+	*screen_ptr = &auth_ctx->device->passphrase_screen;
+
+	return hakomari_set_last_error(auth_ctx->device->ctx, HAKOMARI_OK, NULL);
 }
 
-static hakomari_error_t
-hakomari_send_payload(
-	hakomari_device_t* device, bool first_time, hakomari_input_t* payload
+static void
+hakomari_unpack_bits_8(
+	const uint8_t* bits, size_t index, size_t count,
+	uint8_t* dst, uint8_t fg, uint8_t bg
 )
 {
-	char buf[HAKOMARI_BUF_SIZE];
-	size_t size;
+	// Unaligned head
+	for(; count > 0 && index % 8 != 0; ++index, --count, ++dst)
+	{
+		*dst = (bits[index / 8] >> (index % 8)) & 1 ? fg : bg;
+	}
 
-	hakomari_input_t* source = NULL;
-	if(first_time)
+	const uint8_t* src = bits + index / 8;
+
+#if defined(HAKOMARI_SSE2)
+	const __m128i mask = _mm_set_epi8(
+		-128, 64, 32, 16, 8, 4, 2, 1,
+		-128, 64, 32, 16, 8, 4, 2, 1
+	);
+	const __m128i fg_v = _mm_set1_epi8((char)fg);
+	const __m128i bg_v = _mm_set1_epi8((char)bg);
+	for(; count >= 16; count -= 16, src += 2, dst += 16)
 	{
-		source = payload;
-		hakomari_mem_stream_reset(&device->payload_buff);
+		__m128i v = _mm_unpacklo_epi64(
+			_mm_set1_epi8((char)src[0]), _mm_set1_epi8((char)src[1])
+		);
+		__m128i set = _mm_cmpeq_epi8(_mm_and_si128(v, mask), mask);
+		_mm_storeu_si128(
+			(__m128i*)dst,
+			_mm_or_si128(_mm_and_si128(set, fg_v), _mm_andnot_si128(set, bg_v))
+		);
 	}
-	else
+#elif defined(HAKOMARI_NEON)
+	static const uint8_t mask_bytes[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint8x8_t mask = vld1_u8(mask_bytes);
+	const uint8x8_t fg_v = vdup_n_u8(fg);
+	const uint8x8_t bg_v = vdup_n_u8(bg);
+	for(; count >= 8; count -= 8, src += 1, dst += 8)
 	{
-		source = hakomari_mem_stream_as_input(&device->payload_buff);
+		uint8x8_t set = vtst_u8(vdup_n_u8(src[0]), mask);
+		vst1_u8(dst, vbsl_u8(set, fg_v, bg_v));
 	}
+#endif
 
-	do
+	for(; count >= 8; count -= 8, ++src, dst += 8)
 	{
-		size = HAKOMARI_BUF_SIZE;
-		switch(hakomari_read(source, buf, &size))
+		uint8_t byte = *src;
+		for(unsigned int bit = 0; bit < 8; ++bit)
 		{
-			case HAKOMARI_OK:
-				if(first_time &&
-					!hakomari_mem_stream_write(&device->payload_buff, buf, size)
-				)
-				{
-					return hakomari_set_last_error(
-						device->ctx, HAKOMARI_ERR_MEMORY, NULL
-					);
-				}
-
-				if(slipper_write(
-					&device->slipper, buf, size, HAKOMARI_DEVICE_TIMEOUT
-				) != SLIPPER_OK)
-				{
-					return hakomari_set_last_error(
-						device->ctx, HAKOMARI_ERR_IO, "Error while sending payload"
-					);
-				}
-				break;
-			case HAKOMARI_ERR_IO:
-				return hakomari_set_last_error(
-					device->ctx, HAKOMARI_ERR_IO, "Error while reading payload"
-				);
-			default:
-				return hakomari_set_last_error(
-					device->ctx, HAKOMARI_ERR_INVALID, "Invalid payload stream"
-				);
+			dst[bit] = (byte >> bit) & 1 ? fg : bg;
 		}
-	} while(size);
-
-	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
-}
-
-static hakomari_error_t
-hakomari_query_endpoint_authenticated(
-	hakomari_device_t* device, const hakomari_endpoint_desc_t* desc,
-	bool first_time,
-	const hakomari_string_t query, hakomari_input_t* payload,
-	hakomari_input_t** result
-)
-{
-	hakomari_error_t error;
-	if((error = hakomari_begin_query(device, desc, query)) != HAKOMARI_OK)
-	{
-		return error;
 	}
 
-	if(true
-		&& payload != NULL
-		&& (error = hakomari_send_payload(device, first_time, payload)) != HAKOMARI_OK
-	)
+	for(unsigned int bit = 0; bit < count; ++bit)
 	{
-		return error;
+		dst[bit] = (*src >> bit) & 1 ? fg : bg;
 	}
-
-	return hakomari_end_query(device, result);
 }
 
-static hakomari_error_t
-hakomari_ask_passphrase(
-	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint
+static void
+hakomari_unpack_bits_32(
+	const uint8_t* bits, size_t index, size_t count,
+	uint32_t* dst, uint32_t fg, uint32_t bg
 )
-{
-	hakomari_error_t error;
-	hakomari_auth_handler_t* auth_handler = device->ctx->auth_handler;
-
-	if(auth_handler == NULL)
-	{
-		return HAKOMARI_ERR_AUTH_REQUIRED;
-	}
-
-	// Get specification for the passphrase input screen
-	error = hakomari_query_endpoint_authenticated(
-		device, endpoint, true, "@get-passphrase-screen", NULL, NULL
-	);
-	if(error != HAKOMARI_OK) { return error; }
-
-	uint32_t map_size;
-	if(!cmp_read_map(&device->cmp, &map_size))
+{
+	for(; count > 0 && index % 8 != 0; ++index, --count, ++dst)
 	{
-		return hakomari_set_cmp_error(device);
+		*dst = (bits[index / 8] >> (index % 8)) & 1 ? fg : bg;
 	}
 
-	if(map_size != 3)
+	const uint8_t* src = bits + index / 8;
+
+#if defined(HAKOMARI_SSE2)
+	const __m128i mask_lo = _mm_set_epi32(8, 4, 2, 1);
+	const __m128i mask_hi = _mm_set_epi32(128, 64, 32, 16);
+	const __m128i fg_v = _mm_set1_epi32((int)fg);
+	const __m128i bg_v = _mm_set1_epi32((int)bg);
+	for(; count >= 8; count -= 8, ++src, dst += 8)
 	{
-		return hakomari_set_last_error(
-			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		__m128i v = _mm_set1_epi32(src[0]);
+		__m128i set_lo = _mm_cmpeq_epi32(_mm_and_si128(v, mask_lo), mask_lo);
+		__m128i set_hi = _mm_cmpeq_epi32(_mm_and_si128(v, mask_hi), mask_hi);
+		_mm_storeu_si128(
+			(__m128i*)dst,
+			_mm_or_si128(_mm_and_si128(set_lo, fg_v), _mm_andnot_si128(set_lo, bg_v))
+		);
+		_mm_storeu_si128(
+			(__m128i*)(dst + 4),
+			_mm_or_si128(_mm_and_si128(set_hi, fg_v), _mm_andnot_si128(set_hi, bg_v))
 		);
 	}
-
-	hakomari_passphrase_screen_t* passphrase_screen = &device->passphrase_screen;
-	passphrase_screen->width = passphrase_screen->height = 0;
-	uint32_t image_data_size = 0;
-
-	for(uint32_t i = 0; i < map_size; ++i)
+#elif defined(HAKOMARI_NEON)
+	static const uint32_t mask_lo_words[] = { 1, 2, 4, 8 };
+	static const uint32_t mask_hi_words[] = { 16, 32, 64, 128 };
+	const uint32x4_t mask_lo = vld1q_u32(mask_lo_words);
+	const uint32x4_t mask_hi = vld1q_u32(mask_hi_words);
+	const uint32x4_t fg_v = vdupq_n_u32(fg);
+	const uint32x4_t bg_v = vdupq_n_u32(bg);
+	for(; count >= 8; count -= 8, ++src, dst += 8)
 	{
-		hakomari_string_t key;
-		uint32_t size = sizeof(key);
-
-		if(!cmp_read_str(&device->cmp, key, &size))
-		{
-			return hakomari_set_cmp_error(device);
-		}
-
-		if(strcmp(key, "width") == 0 || strcmp(key, "height") == 0)
-		{
-			uint32_t dim;
-			if(!cmp_read_uint(&device->cmp, &dim))
-			{
-				return hakomari_set_cmp_error(device);
-			}
-
-			if(strcmp(key, "width") == 0)
-			{
-				passphrase_screen->width = dim;
-			}
-			else
-			{
-				passphrase_screen->height = dim;
-			}
-		}
-		else if(strcmp(key, "image_data") == 0)
-		{
-			if(!cmp_read_bin_size(&device->cmp, &image_data_size))
-			{
-				return hakomari_set_cmp_error(device);
-			}
-
-			passphrase_screen->image_data = realloc(
-				passphrase_screen->image_data, image_data_size
-			);
+		uint32x4_t v = vdupq_n_u32(src[0]);
+		vst1q_u32(dst, vbslq_u32(vtstq_u32(v, mask_lo), fg_v, bg_v));
+		vst1q_u32(dst + 4, vbslq_u32(vtstq_u32(v, mask_hi), fg_v, bg_v));
+	}
+#endif
 
-			if(!device->cmp.read(
-				&device->cmp, passphrase_screen->image_data, image_data_size
-			))
-			{
-				return hakomari_set_cmp_error(device);
-			}
-		}
-		else
+	for(; count >= 8; count -= 8, ++src, dst += 8)
+	{
+		uint8_t byte = *src;
+		for(unsigned int bit = 0; bit < 8; ++bit)
 		{
-			return hakomari_set_last_error(
-				device->ctx, HAKOMARI_ERR_IO, "Format error"
-			);
+			dst[bit] = (byte >> bit) & 1 ? fg : bg;
 		}
 	}
 
-	if(passphrase_screen->width * passphrase_screen->height / 8 != image_data_size)
+	for(unsigned int bit = 0; bit < count; ++bit)
 	{
-		return hakomari_set_last_error(
-			device->ctx, HAKOMARI_ERR_IO, "Format error"
-		);
+		dst[bit] = (*src >> bit) & 1 ? fg : bg;
 	}
+}
 
-	// Actual passphrase prompt
-	hakomari_auth_ctx_t auth_ctx = {
-		.device = device,
-		.endpoint = endpoint,
-		.passphrase_inputed = false,
-	};
+hakomari_error_t
+hakomari_unpack_passphrase_screen(
+	const hakomari_passphrase_screen_t* screen,
+	void* dst, size_t pitch, hakomari_pixel_format_t format,
+	uint32_t fg, uint32_t bg
+)
+{
+	return hakomari_unpack_passphrase_screen_rect(
+		screen, NULL, dst, pitch, format, fg, bg
+	);
+}
 
-	error = hakomari_begin_query(device, endpoint, "@input-passphrase");
-	if(error != HAKOMARI_OK) { return error; }
+hakomari_error_t
+hakomari_unpack_passphrase_screen_rect(
+	const hakomari_passphrase_screen_t* screen, const hakomari_rect_t* rect,
+	void* dst, size_t pitch, hakomari_pixel_format_t format,
+	uint32_t fg, uint32_t bg
+)
+{
+	if(screen == NULL || dst == NULL) { return HAKOMARI_ERR_INVALID; }
+
+	hakomari_rect_t area = rect != NULL
+		? *rect
+		: (hakomari_rect_t){ .width = screen->width, .height = screen->height };
 
-	if(slipper_flush(&device->slipper, HAKOMARI_DEVICE_TIMEOUT) != SLIPPER_OK)
+	if(false
+		|| area.x > screen->width || area.width > screen->width - area.x
+		|| area.y > screen->height || area.height > screen->height - area.y
+	)
 	{
-		return HAKOMARI_ERR_IO;
+		return HAKOMARI_ERR_INVALID;
 	}
 
-	error = auth_handler->ask_passphrase(auth_handler->userdata, &auth_ctx);
-	if(error != HAKOMARI_OK) { return error; }
-
-	// Mark end of input stream
-	if(!cmp_write_nil(&device->cmp)) { return hakomari_set_cmp_error(device); }
+	const uint8_t* bits = screen->image_data;
+	uint8_t* row = dst;
+	for(unsigned int y = area.y; y < area.y + area.height; ++y, row += pitch)
+	{
+		size_t index = (size_t)y * screen->width + area.x;
+		switch(format)
+		{
+			case HAKOMARI_PIXEL_FORMAT_8:
+				hakomari_unpack_bits_8(
+					bits, index, area.width, row, (uint8_t)fg, (uint8_t)bg
+				);
+				break;
+			case HAKOMARI_PIXEL_FORMAT_RGBA8888:
+				hakomari_unpack_bits_32(
+					bits, index, area.width, (uint32_t*)row, fg, bg
+				);
+				break;
+			default:
+				return HAKOMARI_ERR_INVALID;
+		}
+	}
 
-	error = hakomari_end_query(device, NULL);
-	if(error != HAKOMARI_OK) { return error; }
+	return HAKOMARI_OK;
+}
 
-	return hakomari_set_last_error(
-		device->ctx,
-		auth_ctx.passphrase_inputed ? HAKOMARI_OK : HAKOMARI_ERR_AUTH_REQUIRED,
-		NULL
-	);
+static bool
+hakomari_write_input_event(
+	hakomari_device_t* device, const struct hakomari_input_event_s* event
+)
+{
+	return true
+		&& cmp_write_array(&device->cmp, 3)
+		&& cmp_write_uint(&device->cmp, event->x)
+		&& cmp_write_uint(&device->cmp, event->y)
+		&& cmp_write_bool(&device->cmp, event->down);
 }
 
 hakomari_error_t
-hakomari_query_endpoint(
-	hakomari_device_t* device, const hakomari_endpoint_desc_t* endpoint,
-	const hakomari_string_t query, hakomari_input_t* payload,
-	hakomari_input_t** result
-)
+hakomari_flush_passphrase_input(hakomari_auth_ctx_t* auth_ctx)
 {
-	HAKOMARI_WITH_AUTH(
-		hakomari_query_endpoint_authenticated,
-		device, endpoint, query, payload, result
-	);
+	hakomari_device_t* device = auth_ctx->device;
+	size_t num_events = auth_ctx->num_pending_events;
+	if(num_events == 0)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	auth_ctx->num_pending_events = 0;
+	for(size_t i = 0; i < num_events; ++i)
+	{
+		if(!hakomari_write_input_event(device, &auth_ctx->pending_events[i]))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+
+	if(hakomari_flush_output(device) != SLIPPER_OK)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_IO, NULL);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
 }
 
 hakomari_error_t
-hakomari_inspect_passphrase_screen(
-	hakomari_auth_ctx_t* auth_ctx,
-	const hakomari_passphrase_screen_t** screen_ptr
+hakomari_passphrase_input_deadline(
+	hakomari_auth_ctx_t* auth_ctx, unsigned int* timeout_ms
 )
 {
-	if(screen_ptr == NULL || auth_ctx == NULL)
+	hakomari_device_t* device = auth_ctx->device;
+	if(timeout_ms == NULL)
 	{
-		return hakomari_set_last_error(
-			auth_ctx->device->ctx, HAKOMARI_ERR_INVALID, NULL
-		);
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
 	}
 
-	*screen_ptr = &auth_ctx->device->passphrase_screen;
+	if(auth_ctx->num_pending_events == 0)
+	{
+		*timeout_ms = HAKOMARI_NO_DEADLINE;
+	}
+	else
+	{
+		uint64_t elapsed = hakomari_now_ms() - auth_ctx->batch_start;
+		*timeout_ms = elapsed < device->input_coalesce_ms
+			? (unsigned int)(device->input_coalesce_ms - elapsed)
+			: 0;
+	}
 
-	return hakomari_set_last_error(auth_ctx->device->ctx, HAKOMARI_OK, NULL);
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
 }
 
 hakomari_error_t
@@ -1019,19 +5996,28 @@ hakomari_input_passphrase(
 	hakomari_device_t* device = auth_ctx->device;
 	auth_ctx->passphrase_inputed |= down;
 
-	if(false
-		|| !cmp_write_array(&device->cmp, 3)
-		|| !cmp_write_uint(&device->cmp, x)
-		|| !cmp_write_uint(&device->cmp, y)
-		|| !cmp_write_bool(&device->cmp, down)
-	)
+	struct hakomari_input_event_s event = { .x = x, .y = y, .down = down };
+	size_t num_events = auth_ctx->num_pending_events;
+	uint64_t now = hakomari_now_ms();
+
+	// Only the latest position of a pointer move matters but every button
+	// press must reach the device.
+	if(num_events > 0 && !down && !auth_ctx->pending_events[num_events - 1].down)
 	{
-		return hakomari_set_cmp_error(device);
+		auth_ctx->pending_events[num_events - 1] = event;
+	}
+	else
+	{
+		if(num_events == 0) { auth_ctx->batch_start = now; }
+		auth_ctx->pending_events[auth_ctx->num_pending_events++] = event;
 	}
 
-	if(slipper_flush(&device->slipper, HAKOMARI_DEVICE_TIMEOUT) != SLIPPER_OK)
+	if(false
+		|| auth_ctx->num_pending_events >= device->input_batch_size
+		|| now - auth_ctx->batch_start >= device->input_coalesce_ms
+	)
 	{
-		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_IO, NULL);
+		return hakomari_flush_passphrase_input(auth_ctx);
 	}
 
 	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
@@ -1052,14 +6038,41 @@ hakomari_enumerate_endpoints(hakomari_device_t* device, size_t* num_endpoints)
 		return hakomari_set_cmp_error(device);
 	}
 
-	device->endpoints = realloc(
-		device->endpoints, device->num_endpoints * sizeof(hakomari_endpoint_desc_t)
-	);
-	if(device->endpoints == NULL)
+	if(device->num_endpoints > device->endpoints_capacity)
 	{
-		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_MEMORY, NULL);
+		if(device->static_storage)
+		{
+			device->num_endpoints = 0;
+			return hakomari_set_last_error(
+				device->ctx, HAKOMARI_ERR_MEMORY, "Too many endpoints"
+			);
+		}
+
+		hakomari_endpoint_desc_t* endpoints = hakomari_device_realloc(
+			device, device->endpoints,
+			device->num_endpoints * sizeof(hakomari_endpoint_desc_t)
+		);
+		if(endpoints != NULL) { device->endpoints = endpoints; }
+
+		uint32_t* endpoint_handles = hakomari_device_realloc(
+			device, device->endpoint_handles,
+			device->num_endpoints * sizeof(uint32_t)
+		);
+		if(endpoint_handles != NULL) { device->endpoint_handles = endpoint_handles; }
+
+		if(endpoints == NULL || endpoint_handles == NULL)
+		{
+			device->num_endpoints = 0;
+			return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_MEMORY, NULL);
+		}
+
+		device->endpoints_capacity = device->num_endpoints;
 	}
 
+	// Handles refer to the previous table
+	hakomari_invalidate_endpoints(device);
+	hakomari_drop_advertised_cache_rules(device);
+
 	for(uint32_t i = 0; i < device->num_endpoints; ++i)
 	{
 		hakomari_error_t error;
@@ -1088,18 +6101,18 @@ hakomari_create_or_destroy_endpoint_authenticated(
 		return error;
 	}
 
-	if(false
-		|| !cmp_write_map(&device->cmp, 2)
-		|| !cmp_write_str(&device->cmp, "type", sizeof("type") - 1)
-		|| !cmp_write_str(&device->cmp, endpoint->type, strlen(endpoint->type))
-		|| !cmp_write_str(&device->cmp, "name", sizeof("name") - 1)
-		|| !cmp_write_str(&device->cmp, endpoint->name, strlen(endpoint->name))
-	)
+	if(!hakomari_write_endpoint_desc(device, endpoint))
 	{
 		return hakomari_set_cmp_error(device);
 	}
 
-	return hakomari_end_query(device, NULL);
+	if((error = hakomari_end_query(device, NULL)) == HAKOMARI_OK)
+	{
+		// The device may hand out handles differently from now on
+		hakomari_invalidate_endpoints(device);
+	}
+
+	return error;
 }
 
 static hakomari_error_t
@@ -1108,6 +6121,8 @@ hakomari_create_or_destroy_endpoint(
 	const char* op
 )
 {
+	if(hakomari_negotiate(device) != HAKOMARI_OK) { return device->ctx->last_error; }
+
 	HAKOMARI_WITH_AUTH(
 		hakomari_create_or_destroy_endpoint_authenticated,
 		device, endpoint, op
@@ -1130,6 +6145,157 @@ hakomari_destroy_endpoint(
 	return hakomari_create_or_destroy_endpoint(device, endpoint, "@destroy");
 }
 
+static hakomari_error_t
+hakomari_create_or_destroy_endpoints_authenticated(
+	hakomari_device_t* device, const hakomari_endpoint_desc_t* descs,
+	bool first_time, size_t num_descs, const char* op,
+	hakomari_error_t* statuses
+)
+{
+	(void)first_time;
+
+	hakomari_error_t error;
+	if((error = hakomari_begin_query(device, NULL, op)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	if(!cmp_write_array(&device->cmp, (uint32_t)num_descs))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	for(size_t i = 0; i < num_descs; ++i)
+	{
+		if(!hakomari_write_endpoint_desc(device, &descs[i]))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+	}
+
+	if((error = hakomari_end_query(device, NULL)) != HAKOMARI_OK)
+	{
+		return error;
+	}
+
+	// Some endpoints may have changed even if others failed
+	hakomari_invalidate_endpoints(device);
+
+	uint32_t size;
+	if(!cmp_read_array(&device->cmp, &size))
+	{
+		return hakomari_set_cmp_error(device);
+	}
+
+	if(size != num_descs)
+	{
+		return hakomari_set_last_error(
+			device->ctx, HAKOMARI_ERR_IO, "Format error"
+		);
+	}
+
+	for(size_t i = 0; i < num_descs; ++i)
+	{
+		uint8_t status;
+		if(!cmp_read_u8(&device->cmp, &status))
+		{
+			return hakomari_set_cmp_error(device);
+		}
+
+		statuses[i] = hakomari_device_status(status);
+	}
+
+	return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+}
+
+static hakomari_error_t
+hakomari_create_or_destroy_many_endpoints(
+	hakomari_device_t* device,
+	const hakomari_endpoint_desc_t* descs, size_t num_descs,
+	const char* op, hakomari_error_t* statuses
+)
+{
+	// The whole transaction authenticates once, as the first endpoint
+	HAKOMARI_WITH_AUTH(
+		hakomari_create_or_destroy_endpoints_authenticated,
+		device, descs, num_descs, op, statuses
+	);
+}
+
+static hakomari_error_t
+hakomari_create_or_destroy_endpoints(
+	hakomari_device_t* device,
+	const hakomari_endpoint_desc_t* descs, size_t num_descs,
+	hakomari_error_t* statuses, const char* op, const char* many_op
+)
+{
+	if(false
+		|| (num_descs > 0 && (descs == NULL || statuses == NULL))
+		|| num_descs > UINT32_MAX
+	)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_ERR_INVALID, NULL);
+	}
+
+	if(num_descs == 0)
+	{
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	if(hakomari_negotiate(device) != HAKOMARI_OK) { return device->ctx->last_error; }
+
+	if(!(device->caps & HAKOMARI_CAP_MANY_ENDPOINTS))
+	{
+		// One at a time: each endpoint may ask for the passphrase so the
+		// first refusal fails the rest instead of asking again
+		for(size_t i = 0; i < num_descs; ++i)
+		{
+			hakomari_error_t status = hakomari_create_or_destroy_endpoint(
+				device, &descs[i], op
+			);
+			statuses[i] = status;
+			if(status == HAKOMARI_ERR_IO || status == HAKOMARI_ERR_AUTH_REQUIRED)
+			{
+				hakomari_fail_batch(statuses + i, num_descs - i, status);
+				return status;
+			}
+		}
+
+		return hakomari_set_last_error(device->ctx, HAKOMARI_OK, NULL);
+	}
+
+	hakomari_error_t error = hakomari_create_or_destroy_many_endpoints(
+		device, descs, num_descs, many_op, statuses
+	);
+	if(error != HAKOMARI_OK) { hakomari_fail_batch(statuses, num_descs, error); }
+
+	return error;
+}
+
+hakomari_error_t
+hakomari_create_endpoints(
+	hakomari_device_t* device,
+	const hakomari_endpoint_desc_t* descs, size_t num_descs,
+	hakomari_error_t* statuses
+)
+{
+	return hakomari_create_or_destroy_endpoints(
+		device, descs, num_descs, statuses, "@create", "@create-many"
+	);
+}
+
+hakomari_error_t
+hakomari_destroy_endpoints(
+	hakomari_device_t* device,
+	const hakomari_endpoint_desc_t* descs, size_t num_descs,
+	hakomari_error_t* statuses
+)
+{
+	return hakomari_create_or_destroy_endpoints(
+		device, descs, num_descs, statuses, "@destroy", "@destroy-many"
+	);
+}
+
 hakomari_error_t
 hakomari_set_auth_handler(
 	hakomari_ctx_t* context, hakomari_auth_handler_t* auth_handler
@@ -7,6 +7,14 @@
 #include <limits.h>
 
 #define SLIPPER_INFINITY UINT_MAX
+#define SLIPPER_CHECKSUM_SIZE 4
+#define SLIPPER_COBS_MIN_MEMORY 256
+
+/**
+ * Upper bound for the output of slipper_encode_message.
+ */
+#define SLIPPER_MAX_ENCODED_SIZE(size) \
+	(2 * ((size) + SLIPPER_CHECKSUM_SIZE) + 2)
 
 #ifndef SLIPPER_API
 #define SLIPPER_API
@@ -17,12 +25,21 @@ typedef struct slipper_ctx_s slipper_ctx_t;
 typedef struct slipper_serial_s slipper_serial_t;
 typedef unsigned int slipper_timeout_t;
 
+typedef enum slipper_framing_e
+{
+	/** RFC 1055 escaping, delimited by 0xC0 */
+	SLIPPER_FRAMING_SLIP,
+	/** Consistent overhead byte stuffing, delimited by 0x00 */
+	SLIPPER_FRAMING_COBS,
+} slipper_framing_t;
+
 typedef enum slipper_error_e
 {
 	SLIPPER_OK,
 	SLIPPER_ERR_IO,
 	SLIPPER_ERR_ENCODING,
 	SLIPPER_ERR_TIMED_OUT,
+	SLIPPER_ERR_CHECKSUM,
 } slipper_error_t;
 
 struct slipper_serial_s
@@ -54,6 +71,19 @@ struct slipper_cfg_s
 	slipper_serial_t serial;
 	size_t memory_size;
 	void* memory;
+
+	/**
+	 * Optional: Running checksum over the content of a message, starting
+	 * from 0. It is appended to every message as SLIPPER_CHECKSUM_SIZE
+	 * little-endian bytes and verified when a message is read.
+	 */
+	uint32_t(*checksum)(uint32_t checksum, const void* data, size_t size);
+
+	/**
+	 * Defaults to SLIPPER_FRAMING_SLIP.
+	 * COBS requires memory_size to be at least SLIPPER_COBS_MIN_MEMORY.
+	 */
+	slipper_framing_t framing;
 };
 
 struct slipper_ctx_s
@@ -61,6 +91,14 @@ struct slipper_ctx_s
 	slipper_cfg_t cfg;
 	size_t cursor;
 	size_t read_limit;
+	uint32_t tx_checksum;
+	uint32_t rx_checksum;
+	bool rx_ended;
+	size_t num_held;
+	uint8_t held[SLIPPER_CHECKSUM_SIZE];
+	size_t tx_code;
+	size_t rx_block_left;
+	bool rx_zero_pending;
 };
 
 static inline void
@@ -81,6 +119,42 @@ slipper_write(
 SLIPPER_API slipper_error_t
 slipper_end_write(slipper_ctx_t* ctx, slipper_timeout_t timeout);
 
+/**
+ * End the current message and begin another one without flushing so that
+ * consecutive messages go out together.
+ */
+SLIPPER_API slipper_error_t
+slipper_next_write(slipper_ctx_t* ctx, slipper_timeout_t timeout);
+
+/**
+ * Escape size bytes from src into dst.
+ * dst must hold at least 2 * size bytes.
+ * Return the number of escaped bytes.
+ */
+SLIPPER_API size_t
+slipper_escape(void* dst, const void* src, size_t size);
+
+/**
+ * Encode a whole message from src into dst using the configured framing,
+ * including delimiters and the checksum.
+ * dst must hold at least SLIPPER_MAX_ENCODED_SIZE(size) bytes.
+ * Return the number of encoded bytes.
+ */
+SLIPPER_API size_t
+slipper_encode_message(
+	const slipper_ctx_t* ctx, void* dst, const void* src, size_t size
+);
+
+/**
+ * Write bytes which were already escaped with slipper_escape.
+ * Only valid with SLIPPER_FRAMING_SLIP.
+ */
+SLIPPER_API slipper_error_t
+slipper_write_raw(
+	slipper_ctx_t* ctx, const void* data, size_t size,
+	slipper_timeout_t timeout
+);
+
 SLIPPER_API slipper_error_t
 slipper_begin_read(slipper_ctx_t* ctx, slipper_timeout_t timeout);
 
@@ -92,6 +166,13 @@ slipper_read(
 SLIPPER_API slipper_error_t
 slipper_end_read(slipper_ctx_t* ctx, slipper_timeout_t timeout);
 
+/**
+ * Skip the rest of the current message and begin reading the next one.
+ * Unlike slipper_begin_read, bytes which were already received are kept.
+ */
+SLIPPER_API slipper_error_t
+slipper_next_read(slipper_ctx_t* ctx, slipper_timeout_t timeout);
+
 SLIPPER_API const char*
 slipper_errorstr(slipper_error_t error);
 
@@ -104,6 +185,8 @@ slipper_errorstr(slipper_error_t error);
 #define SLIPPER_MSG_ESC 0xDB
 #define SLIPPER_MSG_ESC_END 0xDC
 #define SLIPPER_MSG_ESC_ESC 0xDD
+#define SLIPPER_COBS_DELIMITER 0x00
+#define SLIPPER_COBS_MAX_CODE 0xFF
 static const uint8_t SLIPPER_MSG_ESCAPED_END[] = { SLIPPER_MSG_ESC, SLIPPER_MSG_ESC_END };
 static const uint8_t SLIPPER_MSG_ESCAPED_ESC[] = { SLIPPER_MSG_ESC, SLIPPER_MSG_ESC_ESC };
 
@@ -202,14 +285,219 @@ slipper_write_escaped(
 	return SLIPPER_OK;
 }
 
+static inline uint8_t
+slipper_delimiter(const slipper_ctx_t* ctx)
+{
+	return ctx->cfg.framing == SLIPPER_FRAMING_COBS
+		? SLIPPER_COBS_DELIMITER
+		: SLIPPER_MSG_END;
+}
+
 static slipper_error_t
 slipper_write_delimiter(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 {
-	uint8_t header[] = { SLIPPER_MSG_END };
+	uint8_t header[] = { slipper_delimiter(ctx) };
 	size_t size = sizeof(header);
 	return slipper_write_escaped(ctx, header, size, timeout);
 }
 
+static slipper_error_t
+slipper_cobs_reserve(slipper_ctx_t* ctx, slipper_timeout_t timeout)
+{
+	if(ctx->cursor < ctx->cfg.memory_size) { return SLIPPER_OK; }
+
+	// The code of the open block is only known once it ends: send everything
+	// before it and keep the block buffered
+	size_t num_flushed = ctx->tx_code;
+	slipper_error_t error;
+	if((error = ctx->cfg.serial.write(
+		ctx->cfg.serial.userdata, ctx->cfg.memory, num_flushed, true, timeout
+	)) != SLIPPER_OK)
+	{
+		return error;
+	}
+
+	uint8_t* memory = ctx->cfg.memory;
+	memmove(memory, memory + num_flushed, ctx->cursor - num_flushed);
+	ctx->cursor -= num_flushed;
+	ctx->tx_code = 0;
+
+	return SLIPPER_OK;
+}
+
+static slipper_error_t
+slipper_cobs_open_block(slipper_ctx_t* ctx, slipper_timeout_t timeout)
+{
+	ctx->tx_code = ctx->cursor;
+
+	slipper_error_t error;
+	if((error = slipper_cobs_reserve(ctx, timeout)) != SLIPPER_OK)
+	{
+		return error;
+	}
+
+	++ctx->cursor;
+	return SLIPPER_OK;
+}
+
+static void
+slipper_cobs_close_block(slipper_ctx_t* ctx)
+{
+	((uint8_t*)ctx->cfg.memory)[ctx->tx_code] = (uint8_t)(
+		ctx->cursor - ctx->tx_code
+	);
+}
+
+static slipper_error_t
+slipper_write_cobs(
+	slipper_ctx_t* ctx, const void* data, size_t size,
+	slipper_timeout_t timeout
+)
+{
+	const uint8_t* bytes = data;
+	slipper_error_t error;
+
+	while(size)
+	{
+		if(*bytes == 0)
+		{
+			slipper_cobs_close_block(ctx);
+			if((error = slipper_cobs_open_block(ctx, timeout)) != SLIPPER_OK)
+			{
+				return error;
+			}
+
+			++bytes;
+			--size;
+			continue;
+		}
+
+		if((error = slipper_cobs_reserve(ctx, timeout)) != SLIPPER_OK)
+		{
+			return error;
+		}
+
+		// Copy the longest run of non-zero bytes which fits in both the
+		// block and the buffer
+		size_t block_left = SLIPPER_COBS_MAX_CODE - (ctx->cursor - ctx->tx_code);
+		size_t space_left = ctx->cfg.memory_size - ctx->cursor;
+		size_t run_limit = size;
+		if(block_left < run_limit) { run_limit = block_left; }
+		if(space_left < run_limit) { run_limit = space_left; }
+
+		const uint8_t* zero = memchr(bytes, 0, run_limit);
+		size_t run_size = zero != NULL ? (size_t)(zero - bytes) : run_limit;
+		memcpy((uint8_t*)ctx->cfg.memory + ctx->cursor, bytes, run_size);
+		ctx->cursor += run_size;
+		bytes += run_size;
+		size -= run_size;
+
+		// A full block does not imply a zero
+		if(ctx->cursor - ctx->tx_code == SLIPPER_COBS_MAX_CODE)
+		{
+			slipper_cobs_close_block(ctx);
+			if((error = slipper_cobs_open_block(ctx, timeout)) != SLIPPER_OK)
+			{
+				return error;
+			}
+		}
+	}
+
+	return SLIPPER_OK;
+}
+
+static slipper_error_t
+slipper_write_unchecked(
+	slipper_ctx_t* ctx, const void* data, size_t size,
+	slipper_timeout_t timeout
+);
+
+static slipper_error_t
+slipper_end_message(slipper_ctx_t* ctx, slipper_timeout_t timeout)
+{
+	slipper_error_t error;
+	if(ctx->cfg.checksum != NULL)
+	{
+		uint32_t checksum = ctx->tx_checksum;
+		uint8_t trailer[SLIPPER_CHECKSUM_SIZE] = {
+			(uint8_t)checksum, (uint8_t)(checksum >> 8),
+			(uint8_t)(checksum >> 16), (uint8_t)(checksum >> 24),
+		};
+		ctx->tx_checksum = 0;
+		if((error = slipper_write_unchecked(
+			ctx, trailer, sizeof(trailer), timeout
+		)) != SLIPPER_OK)
+		{
+			return error;
+		}
+	}
+
+	if(ctx->cfg.framing == SLIPPER_FRAMING_COBS) { slipper_cobs_close_block(ctx); }
+
+	return slipper_write_delimiter(ctx, timeout);
+}
+
+static void
+slipper_checksum_escaped(slipper_ctx_t* ctx, const void* data, size_t size)
+{
+	const uint8_t* in = data;
+	uint8_t decoded[64];
+	size_t num_decoded = 0;
+
+	for(size_t i = 0; i < size; ++i)
+	{
+		uint8_t byte = in[i];
+		if(byte == SLIPPER_MSG_ESC && i + 1 < size)
+		{
+			byte = in[++i] == SLIPPER_MSG_ESC_END
+				? SLIPPER_MSG_END
+				: SLIPPER_MSG_ESC;
+		}
+
+		decoded[num_decoded++] = byte;
+		if(num_decoded == sizeof(decoded) || i + 1 == size)
+		{
+			ctx->tx_checksum = ctx->cfg.checksum(
+				ctx->tx_checksum, decoded, num_decoded
+			);
+			num_decoded = 0;
+		}
+	}
+}
+
+static size_t
+slipper_hold_back(slipper_ctx_t* ctx, uint8_t* buf, size_t size)
+{
+	// The last bytes of a message are its checksum: only release what is
+	// known to come before them
+	size_t num_total = ctx->num_held + size;
+	if(num_total <= SLIPPER_CHECKSUM_SIZE)
+	{
+		memcpy(ctx->held + ctx->num_held, buf, size);
+		ctx->num_held = num_total;
+		return 0;
+	}
+
+	size_t num_released = num_total - SLIPPER_CHECKSUM_SIZE;
+	uint8_t scratch[SLIPPER_CHECKSUM_SIZE * 2];
+	if(size >= SLIPPER_CHECKSUM_SIZE)
+	{
+		memcpy(scratch, buf + size - SLIPPER_CHECKSUM_SIZE, SLIPPER_CHECKSUM_SIZE);
+		memmove(buf + ctx->num_held, buf, size - SLIPPER_CHECKSUM_SIZE);
+		memcpy(buf, ctx->held, ctx->num_held);
+		memcpy(ctx->held, scratch, SLIPPER_CHECKSUM_SIZE);
+	}
+	else
+	{
+		memcpy(scratch, ctx->held, ctx->num_held);
+		memcpy(scratch + ctx->num_held, buf, size);
+		memcpy(buf, scratch, num_released);
+		memcpy(ctx->held, scratch + num_released, SLIPPER_CHECKSUM_SIZE);
+	}
+
+	ctx->num_held = SLIPPER_CHECKSUM_SIZE;
+	return num_released;
+}
 
 const char*
 slipper_errorstr(slipper_error_t error)
@@ -224,6 +512,8 @@ slipper_errorstr(slipper_error_t error)
 			return "Encoding error";
 		case SLIPPER_ERR_TIMED_OUT:
 			return "Timed out";
+		case SLIPPER_ERR_CHECKSUM:
+			return "Checksum mismatch";
 		default:
 			return "Sum Ting Wong";
 	}
@@ -233,7 +523,17 @@ slipper_error_t
 slipper_begin_write(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 {
 	ctx->cursor = 0;
-	return slipper_write_delimiter(ctx, timeout);
+	ctx->tx_checksum = 0;
+
+	slipper_error_t error;
+	if((error = slipper_write_delimiter(ctx, timeout)) != SLIPPER_OK)
+	{
+		return error;
+	}
+
+	return ctx->cfg.framing == SLIPPER_FRAMING_COBS
+		? slipper_cobs_open_block(ctx, timeout)
+		: SLIPPER_OK;
 }
 
 slipper_error_t
@@ -241,7 +541,7 @@ slipper_end_write(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 {
 	slipper_error_t error;
 
-	if((error = slipper_write_delimiter(ctx, timeout)) != SLIPPER_OK)
+	if((error = slipper_end_message(ctx, timeout)) != SLIPPER_OK)
 	{
 		return error;
 	}
@@ -254,42 +554,171 @@ slipper_end_write(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 	return SLIPPER_OK;
 }
 
+slipper_error_t
+slipper_next_write(slipper_ctx_t* ctx, slipper_timeout_t timeout)
+{
+	// A single delimiter both ends a message and begins the next
+	slipper_error_t error;
+	if((error = slipper_end_message(ctx, timeout)) != SLIPPER_OK)
+	{
+		return error;
+	}
+
+	return ctx->cfg.framing == SLIPPER_FRAMING_COBS
+		? slipper_cobs_open_block(ctx, timeout)
+		: SLIPPER_OK;
+}
+
 slipper_error_t
 slipper_write(
 	slipper_ctx_t* ctx, const void* data, size_t size,
 	slipper_timeout_t timeout
 )
 {
-	for(size_t i = 0; i < size; ++i)
+	if(ctx->cfg.checksum != NULL)
 	{
-		uint8_t byte = ((const uint8_t*)data)[i];
-		const uint8_t* bytes;
-		size_t data_size;
+		ctx->tx_checksum = ctx->cfg.checksum(ctx->tx_checksum, data, size);
+	}
 
-		switch(byte)
+	return slipper_write_unchecked(ctx, data, size, timeout);
+}
+
+static slipper_error_t
+slipper_write_unchecked(
+	slipper_ctx_t* ctx, const void* data, size_t size,
+	slipper_timeout_t timeout
+)
+{
+	if(ctx->cfg.framing == SLIPPER_FRAMING_COBS)
+	{
+		return slipper_write_cobs(ctx, data, size, timeout);
+	}
+
+	const uint8_t* bytes = data;
+	size_t i = 0;
+
+	while(i < size)
+	{
+		// Runs without special bytes are written as a whole
+		size_t run_end = i;
+		while(true
+			&& run_end < size
+			&& bytes[run_end] != SLIPPER_MSG_END
+			&& bytes[run_end] != SLIPPER_MSG_ESC
+		)
+		{
+			++run_end;
+		}
+
+		slipper_error_t error;
+		if(run_end > i && (error = slipper_write_escaped(
+			ctx, bytes + i, run_end - i, timeout
+		)) != SLIPPER_OK)
+		{
+			return error;
+		}
+
+		if(run_end == size) { break; }
+
+		const uint8_t* escaped = bytes[run_end] == SLIPPER_MSG_END
+			? SLIPPER_MSG_ESCAPED_END
+			: SLIPPER_MSG_ESCAPED_ESC;
+		if((error = slipper_write_escaped(ctx, escaped, 2, timeout)) != SLIPPER_OK)
+		{
+			return error;
+		}
+
+		i = run_end + 1;
+	}
+
+	return SLIPPER_OK;
+}
+
+size_t
+slipper_escape(void* dst, const void* src, size_t size)
+{
+	uint8_t* out = dst;
+	const uint8_t* in = src;
+
+	for(size_t i = 0; i < size; ++i)
+	{
+		switch(in[i])
 		{
-			case SLIPPER_MSG_ESC:
-				bytes = SLIPPER_MSG_ESCAPED_ESC;
-				data_size = sizeof(SLIPPER_MSG_ESCAPED_ESC);
-				break;
 			case SLIPPER_MSG_END:
-				bytes = SLIPPER_MSG_ESCAPED_END;
-				data_size = sizeof(SLIPPER_MSG_ESCAPED_END);
+				*out++ = SLIPPER_MSG_ESC;
+				*out++ = SLIPPER_MSG_ESC_END;
+				break;
+			case SLIPPER_MSG_ESC:
+				*out++ = SLIPPER_MSG_ESC;
+				*out++ = SLIPPER_MSG_ESC_ESC;
 				break;
 			default:
-				bytes = &byte;
-				data_size = sizeof(byte);
+				*out++ = in[i];
 				break;
 		}
+	}
 
-		slipper_error_t error;
-		if((error = slipper_write_escaped(ctx, bytes, data_size, timeout)) != SLIPPER_OK)
+	return (size_t)(out - (uint8_t*)dst);
+}
+
+size_t
+slipper_encode_message(
+	const slipper_ctx_t* ctx, void* dst, const void* src, size_t size
+)
+{
+	uint8_t* out = dst;
+	const uint8_t* in = src;
+	uint8_t delimiter = slipper_delimiter(ctx);
+	size_t out_size = 0;
+
+	uint8_t trailer[SLIPPER_CHECKSUM_SIZE];
+	size_t trailer_size = 0;
+	if(ctx->cfg.checksum != NULL)
+	{
+		uint32_t checksum = ctx->cfg.checksum(0, src, size);
+		for(; trailer_size < SLIPPER_CHECKSUM_SIZE; ++trailer_size)
 		{
-			return error;
+			trailer[trailer_size] = (uint8_t)(checksum >> (trailer_size * 8));
 		}
 	}
 
-	return SLIPPER_OK;
+	out[out_size++] = delimiter;
+	if(ctx->cfg.framing == SLIPPER_FRAMING_COBS)
+	{
+		size_t code = out_size++;
+		for(size_t i = 0; i < size + trailer_size; ++i)
+		{
+			uint8_t byte = i < size ? in[i] : trailer[i - size];
+			if(byte != 0) { out[out_size++] = byte; }
+
+			if(byte == 0 || out_size - code == SLIPPER_COBS_MAX_CODE)
+			{
+				out[code] = (uint8_t)(out_size - code);
+				code = out_size++;
+			}
+		}
+
+		out[code] = (uint8_t)(out_size - code);
+	}
+	else
+	{
+		out_size += slipper_escape(out + out_size, src, size);
+		out_size += slipper_escape(out + out_size, trailer, trailer_size);
+	}
+	out[out_size++] = delimiter;
+
+	return out_size;
+}
+
+slipper_error_t
+slipper_write_raw(
+	slipper_ctx_t* ctx, const void* data, size_t size,
+	slipper_timeout_t timeout
+)
+{
+	if(ctx->cfg.checksum != NULL) { slipper_checksum_escaped(ctx, data, size); }
+
+	return slipper_write_escaped(ctx, data, size, timeout);
 }
 
 slipper_error_t
@@ -304,7 +733,7 @@ slipper_end_read(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 		{
 			return error;
 		}
-	} while(byte != SLIPPER_MSG_END);
+	} while(byte != slipper_delimiter(ctx));
 
 	return SLIPPER_OK;
 }
@@ -312,11 +741,17 @@ slipper_end_read(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 slipper_error_t
 slipper_begin_read(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 {
-	slipper_error_t error;
-
 	ctx->cursor = 0;
 	ctx->read_limit = 0;
 
+	return slipper_next_read(ctx, timeout);
+}
+
+slipper_error_t
+slipper_next_read(slipper_ctx_t* ctx, slipper_timeout_t timeout)
+{
+	slipper_error_t error;
+
 	if((error = slipper_end_read(ctx, timeout)) != SLIPPER_OK)
 	{
 		return error;
@@ -329,15 +764,20 @@ slipper_begin_read(slipper_ctx_t* ctx, slipper_timeout_t timeout)
 		{
 			return error;
 		}
-	} while(byte == SLIPPER_MSG_END);
+	} while(byte == slipper_delimiter(ctx));
 
 	--ctx->cursor;
+	ctx->rx_checksum = 0;
+	ctx->rx_ended = false;
+	ctx->num_held = 0;
+	ctx->rx_block_left = 0;
+	ctx->rx_zero_pending = false;
 
 	return SLIPPER_OK;
 }
 
-slipper_error_t
-slipper_read(
+static slipper_error_t
+slipper_read_cobs(
 	slipper_ctx_t* ctx, void* data, size_t* size, slipper_timeout_t timeout
 )
 {
@@ -345,11 +785,108 @@ slipper_read(
 	size_t bytes_read = 0;
 	size_t num_bytes = *size;
 
+	while(bytes_read < num_bytes)
+	{
+		slipper_error_t error;
+		if((error = slipper_ensure_read_buf(ctx, timeout)) != SLIPPER_OK)
+		{
+			return error;
+		}
+
+		const uint8_t* buffered = (const uint8_t*)ctx->cfg.memory + ctx->cursor;
+		size_t num_buffered = ctx->read_limit - ctx->cursor;
+
+		if(ctx->rx_block_left == 0)
+		{
+			if(*buffered == SLIPPER_COBS_DELIMITER)
+			{
+				// Leave the delimiter in place to make end status sticky
+				break;
+			}
+
+			if(ctx->rx_zero_pending)
+			{
+				ctx->rx_zero_pending = false;
+				read_buf[bytes_read++] = 0;
+				continue;
+			}
+
+			uint8_t code = *buffered;
+			++ctx->cursor;
+			ctx->rx_block_left = code - 1;
+			ctx->rx_zero_pending = code != SLIPPER_COBS_MAX_CODE;
+			continue;
+		}
+
+		// The block length is known up front so it is copied as a whole
+		size_t run_size = num_bytes - bytes_read;
+		if(ctx->rx_block_left < run_size) { run_size = ctx->rx_block_left; }
+		if(num_buffered < run_size) { run_size = num_buffered; }
+
+		if(memchr(buffered, SLIPPER_COBS_DELIMITER, run_size) != NULL)
+		{
+			return SLIPPER_ERR_ENCODING;
+		}
+
+		memcpy(read_buf + bytes_read, buffered, run_size);
+		ctx->cursor += run_size;
+		ctx->rx_block_left -= run_size;
+		bytes_read += run_size;
+	}
+
+	*size = bytes_read;
+	return SLIPPER_OK;
+}
+
+static slipper_error_t
+slipper_read_decoded(
+	slipper_ctx_t* ctx, void* data, size_t* size, slipper_timeout_t timeout
+)
+{
+	if(ctx->cfg.framing == SLIPPER_FRAMING_COBS)
+	{
+		return slipper_read_cobs(ctx, data, size, timeout);
+	}
+
+	uint8_t* read_buf = data;
+	size_t bytes_read = 0;
+	size_t num_bytes = *size;
+
 	while(bytes_read < num_bytes)
 	{
 		uint8_t byte;
 		slipper_error_t error;
 
+		if((error = slipper_ensure_read_buf(ctx, timeout)) != SLIPPER_OK)
+		{
+			return error;
+		}
+
+		// Copy the buffered run without special bytes as a whole
+		const uint8_t* buffered = (const uint8_t*)ctx->cfg.memory + ctx->cursor;
+		size_t num_buffered = ctx->read_limit - ctx->cursor;
+		size_t run_limit = num_bytes - bytes_read;
+		if(num_buffered < run_limit) { run_limit = num_buffered; }
+
+		size_t run_size = 0;
+		while(true
+			&& run_size < run_limit
+			&& buffered[run_size] != SLIPPER_MSG_END
+			&& buffered[run_size] != SLIPPER_MSG_ESC
+		)
+		{
+			++run_size;
+		}
+
+		if(run_size > 0)
+		{
+			memcpy(read_buf, buffered, run_size);
+			ctx->cursor += run_size;
+			read_buf += run_size;
+			bytes_read += run_size;
+			continue;
+		}
+
 		if((error = slipper_read_byte(ctx, &byte, timeout)) != SLIPPER_OK)
 		{
 			return error;
@@ -392,6 +929,59 @@ slipper_read(
 	return SLIPPER_OK;
 }
 
+slipper_error_t
+slipper_read(
+	slipper_ctx_t* ctx, void* data, size_t* size, slipper_timeout_t timeout
+)
+{
+	if(ctx->cfg.checksum == NULL)
+	{
+		return slipper_read_decoded(ctx, data, size, timeout);
+	}
+
+	uint8_t* read_buf = data;
+	size_t bytes_read = 0;
+	size_t num_bytes = *size;
+
+	while(bytes_read < num_bytes && !ctx->rx_ended)
+	{
+		slipper_error_t error;
+		size_t requested_size = num_bytes - bytes_read;
+		size_t num_decoded = requested_size;
+		if((error = slipper_read_decoded(
+			ctx, read_buf + bytes_read, &num_decoded, timeout
+		)) != SLIPPER_OK)
+		{
+			return error;
+		}
+
+		size_t num_released = slipper_hold_back(
+			ctx, read_buf + bytes_read, num_decoded
+		);
+		ctx->rx_checksum = ctx->cfg.checksum(
+			ctx->rx_checksum, read_buf + bytes_read, num_released
+		);
+		bytes_read += num_released;
+
+		if(num_decoded < requested_size)
+		{
+			ctx->rx_ended = true;
+
+			uint32_t checksum = (uint32_t)ctx->held[0]
+				| (uint32_t)ctx->held[1] << 8
+				| (uint32_t)ctx->held[2] << 16
+				| (uint32_t)ctx->held[3] << 24;
+			if(ctx->num_held != SLIPPER_CHECKSUM_SIZE || checksum != ctx->rx_checksum)
+			{
+				return SLIPPER_ERR_CHECKSUM;
+			}
+		}
+	}
+
+	*size = bytes_read;
+	return SLIPPER_OK;
+}
+
 #endif
 
 #endif